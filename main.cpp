@@ -1,21 +1,66 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <deque>
 #include <memory>
 #include <random>
+#include <string>
+#include <thread>
 #include <utility>
+#include <vector>
+
+// Optional parts, chosen at build time (see the Makefile): the HUD, the
+// text drawn over the playfield, is the only user of SDL_ttf; nothing uses
+// SDL_image yet, so it is left out unless asked for.
+#ifndef DH_WITH_HUD
+#define DH_WITH_HUD 1
+#endif
+#ifndef DH_WITH_IMAGE
+#define DH_WITH_IMAGE 0
+#endif
 
 #include <SDL.h>
+#if DH_WITH_IMAGE
 #include <SDL_image.h>
+#endif
+#if DH_WITH_HUD
 #include <SDL_ttf.h>
+#endif
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #endif
 
+// Compiled pattern packs are memory-mapped where the platform allows it and
+// read into memory otherwise.
+#if defined(__unix__) || defined(__APPLE__)
+#define DH_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+
+// The pattern file is watched with inotify on Linux and by polling its
+// modification time elsewhere.
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define DH_INOTIFY 1
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+// Browsers only get threads in a pthreads build; without them everything
+// runs on the main thread.
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define DH_THREADS 1
+#endif
+
 struct delete_sdl
 {
     void operator()(SDL_Texture *p) const
@@ -45,20 +90,47 @@ const int FONT_HEIGHT = 16;
 const int BAND_THICKNESS = 16;
 
 SDL_Window *win = NULL;
+#if DH_WITH_HUD
 TTF_Font *font = NULL;
+#endif
 SDL_Renderer *ren = NULL;
 sdl_ptr<SDL_Texture> canvas;
 
+void StopSimulation();
+void StopShadeThread();
+void StopBeatDetection();
+void StopMusic();
+void StopPatternWatch();
+void StopGeometryWorker();
+void StopAssetLoad();
+
+void PrintLatencyReport();
+
 void cleanup()
 {
+    StopAssetLoad();
+    StopShadeThread();
+    StopSimulation();
+    StopPatternWatch();
+    StopGeometryWorker();
+    StopBeatDetection();
+    StopMusic();
+    PrintLatencyReport();
+
     // Must destroy textures here because global destructors haven't run yet.
     canvas.reset();
 
     if (ren) SDL_DestroyRenderer(ren);
+#if DH_WITH_HUD
     if (font) TTF_CloseFont(font);
+#endif
     if (win) SDL_DestroyWindow(win);
+#if DH_WITH_IMAGE
     IMG_Quit();
+#endif
+#if DH_WITH_HUD
     TTF_Quit();
+#endif
     SDL_Quit();
 }
 
@@ -74,24 +146,52 @@ void failSDL(const char *msg)
     exit(1);
 }
 
+#if DH_WITH_HUD
 void failTTF(const char *msg)
 {
     std::printf("TTF %s failed: %s\n", msg, TTF_GetError());
     exit(1);
 }
+#endif
 
+#if DH_WITH_IMAGE
 void failIMG(const char *msg)
 {
     std::printf("IMG %s failed: %s\n", msg, IMG_GetError());
     exit(1);
 }
+#endif
+
+// Where and why a file couldn't be loaded. line and column count from 1,
+// and are 0 when the problem isn't at one place in a text file.
+struct LoadError
+{
+    std::string file;
+    int line;
+    int column;
+    std::string reason;
+};
+
+std::string DescribeLoadError(const LoadError &err)
+{
+    std::string s = err.file;
+    if (err.line) s += ":" + std::to_string(err.line) + ":" + std::to_string(err.column);
+    return s + ": " + err.reason;
+}
 
-SDL_Texture * LoadTexture(const char *path)
+#if DH_WITH_IMAGE
+// Returns NULL and sets err on failure.
+SDL_Texture * LoadTexture(const char *path, LoadError &err)
 {
     SDL_Texture *tex = IMG_LoadTexture(ren, path);
-    if (!tex) failIMG("LoadTexture");
+    if (!tex) {
+        err.file = path;
+        err.line = err.column = 0;
+        err.reason = IMG_GetError();
+    }
     return tex;
 }
+#endif
 
 std::minstd_rand rng;
 int RandInt(int lo, int hi)
@@ -110,366 +210,3769 @@ const int BAND_TYPE_NONE = 0;
 const int BAND_TYPE_WALL = 1;
 const int BAND_TYPE_HURDLE = 2;
 
-int nlanes;
-int incoming[LANES_MAX][LEVEL_LEN];
-int offset;
-int playerLane;
-bool playerAlive;
-bool playerHurdling;
+// A generated level. Never modified once generated, so the simulation and
+// the renderer can share it.
+struct Level
+{
+    int nlanes;
+    // Bitmasks of the lanes with a wall or a hurdle at each beat.
+    uint16_t walls[LEVEL_LEN];
+    uint16_t hurdles[LEVEL_LEN];
+};
+
+const int INPUT_HISTORY = 16;
+
+// Simulation state. The simulation owns one of these and publishes copies
+// for the renderer.
+struct GameState
+{
+    std::shared_ptr<const Level> level;
+    // The pattern file the level came from (see --hyper).
+    int section;
+    int offset;
+    int playerLane;
+    bool playerAlive;
+    bool playerHurdling;
+    // Performance counter at the last Advance(), for animation.
+    Uint64 advanceTime;
+
+    // For latency measurement: count of inputs applied, and for the most
+    // recent ones, when each was polled and when it was applied.
+    unsigned inputSeq;
+    Uint64 inputPollTime[INPUT_HISTORY];
+    Uint64 inputApplyTime[INPUT_HISTORY];
+
+    // Beat clock: when beat 0 of this level's timeline falls (0 until the
+    // clock starts), the last beat an input was judged against, and how
+    // the inputs have been judged.
+    Uint64 beatOrigin;
+    long long lastBeat;
+    int judgement;
+    double judgeError_ms;
+    int judgeCounts[4];
+};
+
+const int JUDGE_NONE = 0;
+const int JUDGE_PERFECT = 1;
+const int JUDGE_GOOD = 2;
+const int JUDGE_MISS = 3;
+
+const double JUDGE_PERFECT_MS = 45.0;
+const double JUDGE_GOOD_MS = 90.0;
+
+// Optional beat clock, read from a sidecar file: beats fall every 60/bpm
+// seconds, starting offset ms after the clock's origin. Beat times are
+// always computed from the origin on the performance counter timeline, never
+// by accumulating frame deltas, so they don't drift or jitter.
+bool beatClock = false;
+bool beatStrict = false;
+// From the sidecar file; 0 bpm if the grid is to be detected from the music.
+// Set while parsing arguments and only read afterwards.
+double beatBpm;
+double beatOffset_ms;
+// The grid inputs are judged against: a copy of the above or of the detected
+// one, owned by the simulation thread.
+double judgeBpm;
+double judgeOffset_ms;
+
+const int INPUT_LEFT = 0;
+const int INPUT_RIGHT = 1;
+const int INPUT_STAY = 2;
+const int INPUT_HURDLE = 3;
+const int INPUT_RESTART = 4;
+const int INPUT_NEXT_PATTERNS = 5;
+
+struct InputEvent
+{
+    int type;
+    // Performance counter when the event was polled.
+    Uint64 time;
+};
+
+// Lock-free queue for exactly one producer thread and one consumer thread.
+// N must be a power of two.
+template<class T, unsigned N>
+class SpscQueue
+{
+public:
+    SpscQueue() : head(0), tail(0) {}
+
+    bool Push(const T &item)
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        items[t % N] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T *item)
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        *item = items[h % N];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T items[N];
+    alignas(64) std::atomic<unsigned> head;
+    alignas(64) std::atomic<unsigned> tail;
+};
+
+// Triple buffer for one writer and one reader: the writer always has a slot
+// to fill and the reader always has a complete value, and neither waits.
+template<class T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : shared(1), writeIndex(0), readIndex(2) {}
+
+    T &Back() { return slots[writeIndex]; }
+
+    void Publish()
+    {
+        writeIndex = shared.exchange(writeIndex | DIRTY, std::memory_order_acq_rel) & INDEX;
+    }
+
+    // Take the newest published value, if there is one since the last call.
+    bool Fetch()
+    {
+        if (!(shared.load(std::memory_order_relaxed) & DIRTY)) return false;
+        readIndex = shared.exchange(readIndex, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    const T &Front() const { return slots[readIndex]; }
+
+private:
+    static const int INDEX = 3;
+    static const int DIRTY = 4;
+
+    T slots[3];
+    std::atomic<int> shared;
+    int writeIndex;
+    int readIndex;
+};
+
+// Input flows from the main thread to the simulation through inputQueue, and
+// state flows back through published. sim belongs to the simulation thread;
+// view is the snapshot the current frame is drawn from.
+SpscQueue<InputEvent, 256> inputQueue;
+TripleBuffer<GameState> published;
+GameState sim;
+GameState view;
+#ifdef DH_THREADS
+std::thread simThread;
+SDL_sem *simWake = NULL;
+std::atomic<bool> simQuit(false);
+#endif
 
 Uint32 prevFrame_ms;
+// Derived each frame from view.advanceTime.
 Uint32 timeSinceAdvance_ms;
 
 double renderAvgTime_ms;
 double renderAvgDenom;
 const double renderAvg_decay = 0.99;
 
+// Internal render scale: render() shades a renderW x renderH corner of the
+// canvas and SDL_RenderCopy stretches it over the window.
+const double RENDER_SCALE_MIN = 0.25;
+const double RENDER_SCALE_MAX = 1.0;
+double renderScale = 1.0;
+bool renderScaleAuto = false;
+double targetFrame_ms = 1000.0 / 60.0;
+SDL_ScaleMode renderScaleFilter = SDL_ScaleModeNearest;
+int renderW = WIDTH;
+int renderH = HEIGHT;
+int renderSrcX[WIDTH];
+int renderSrcY[HEIGHT];
+
+// Smoothed costs used by the automatic scale controller.
+double shadeAvgTime_ms;
+double shadeAvgTimePerPixel_ms;
+double frameAvgTime_ms;
+const double scaleAvg_decay = 0.9;
+
 bool quitRequested;
+bool measureLatency = false;
+
+// How the playfield is drawn. The CPU rasterizer is the reference; the
+// geometry renderer hands the same shapes to SDL as triangles.
+const int RENDERER_CPU = 0;
+const int RENDERER_GEOMETRY = 1;
+int rendererType = RENDERER_CPU;
+bool softwareRenderer = false;
+bool antialias = false;
+bool pipelinedRender = false;
+
+// Camera rotation, in 1/65536ths of a turn clockwise. When enabled the
+// camera eases towards keeping the player's lane at the top of the screen.
+bool rotateCamera = false;
+double cameraTurns;
+uint16_t cameraAngle;
+const double CAMERA_EASE_MS = 40.0;
+
+// Frame pacing. A negative fpsCap means the default: uncapped with vsync,
+// DEFAULT_FPS_CAP without.
+bool vsync = false;
+double fpsCap = -1;
+bool powerSave = true;
+const double DEFAULT_FPS_CAP = 120;
+const double POWER_SAVE_FPS = 10;
+const Uint32 IDLE_MS = 2000;
+const double LIMITER_SPIN_MS = 2.0;
+Uint64 frameDeadline;
+Uint32 lastInput_ms;
+
+// Each pattern row holds its walls and hurdles as bitmasks, bit k for lane k.
+struct PatternRow
+{
+    uint16_t walls;
+    uint16_t hurdles;
+};
+
+// The rows of one pattern, as a range of the library's rows.
+struct PatternSpan
+{
+    uint32_t first;
+    uint32_t count;
+};
 
-struct Pattern
+// One column of an alias table (Vose's method): choose a column uniformly,
+// then its own outcome with probability prob and otherwise its alias.
+struct AliasColumn
 {
-    std::vector<std::string> rows;
+    float prob;
+    uint32_t outcome;
+    uint32_t alias;
 };
-std::vector<Pattern> patterns;
 
-void ReadPatterns()
+// A compiled pattern pack is this header, then the npatterns spans, the
+// nvariants variant spans, the variant index (npatterns * 2 * nlanes), the
+// npatterns selection columns, the npatterns transition spans, the
+// ntransitionColumns transition columns, the nrows rows and the nvariantRows
+// variant rows, in the native (little-endian) layout of the structs
+// themselves.
+const char PACK_MAGIC[4] = { 'D', 'H', 'P', 'K' };
+const uint32_t PACK_VERSION = 3;
+
+struct PackHeader
 {
-    patterns.clear();
+    char magic[4];
+    uint32_t version;
+    uint32_t nlanes;
+    uint32_t npatterns;
+    uint32_t nrows;
+    uint32_t nvariants;
+    uint32_t nvariantRows;
+    uint32_t ntransitionColumns;
+};
 
-    FILE * f = fopen("data/patterns.txt", "r");
-    if (!f) failAny("fopen data/patterns.txt");
+// Spans and rows point either into a loaded pack or into the storage vectors
+// when the library was parsed from text.
+struct PatternLibrary
+{
+    int nlanes = 0;
+    uint32_t npatterns = 0;
+    uint32_t nrows = 0;
+    const PatternSpan *spans = NULL;
+    const PatternRow *rows = NULL;
+
+    std::vector<PatternSpan> spanStorage;
+    std::vector<PatternRow> rowStorage;
+    std::vector<uint32_t> packStorage;
+    void *mapping = NULL;
+    size_t mappingSize = 0;
+
+    // Every rotation and flip of every pattern, built when parsing text and
+    // stored in packs. Transform t of pattern p is
+    // variants[variantOf[p * ntransforms + t]]; transforms that give identical
+    // rows (symmetric patterns) share one variant.
+    int ntransforms = 0;
+    uint32_t nvariants = 0;
+    uint32_t nvariantRows = 0;
+    const PatternSpan *variants = NULL;
+    const PatternRow *variantRows = NULL;
+    const uint32_t *variantOf = NULL;
+
+    std::vector<PatternSpan> variantStorage;
+    std::vector<PatternRow> variantRowStorage;
+    std::vector<uint32_t> variantOfStorage;
+
+    // Alias tables for choosing patterns: select draws by the patterns'
+    // weights, and the pattern after p is drawn from its transitions,
+    // transitionSpans[p] of transitionColumns, unless that span is empty.
+    uint32_t ntransitionColumns = 0;
+    const AliasColumn *select = NULL;
+    const PatternSpan *transitionSpans = NULL;
+    const AliasColumn *transitionColumns = NULL;
+
+    std::vector<AliasColumn> selectStorage;
+    std::vector<PatternSpan> transitionSpanStorage;
+    std::vector<AliasColumn> transitionColumnStorage;
+
+    PatternLibrary() {}
+    PatternLibrary(const PatternLibrary &) = delete;
+    PatternLibrary &operator=(const PatternLibrary &) = delete;
+
+    ~PatternLibrary()
+    {
+#ifdef DH_MMAP
+        if (mapping) munmap(mapping, mappingSize);
+#endif
+    }
+};
 
-    if (fscanf(f, " %d", &nlanes) != 1) failAny("could not read number of lanes");
-    printf("Geometry has %d lanes\n", nlanes);
-    if (nlanes < LANES_MIN || LANES_MAX < nlanes) failAny("number of lanes out of bounds");
+const char *patternsPath = "data/patterns.txt";
 
-    for (int i = 0; ; ++i) {
-        Pattern p;
-        printf("Pattern %d:\n", i);
-        int plen;
-        if (fscanf(f, " %d", &plen) != 1) failAny("could not read pattern length");
+// --hyper FILE: more pattern files, usually with other lane counts. Tab
+// moves on to the next file, and reaching the end of a level carries
+// straight on into a level from the next file.
+const int PATTERN_FILES_MAX = 8;
+std::vector<const char *> hyperPaths;
 
-        if (plen == 0) {
-            printf("Read terminating 0\n");
-            break;
-        }
+int PatternFileCount()
+{
+    return 1 + hyperPaths.size();
+}
 
-        for (int j = 0; j < plen; ++j) {
-            char buf[256];
-            if (fscanf(f, " %255s", buf) != 1) failAny("could not read pattern row");
-            std::string row = buf;
-            printf("%s\n", row.c_str());
-            if (row.size() != nlanes) failAny("incorrect length of pattern row");
-            p.rows.push_back(buf);
+const char *PatternFilePath(int file)
+{
+    return file ? hyperPaths[file - 1] : patternsPath;
+}
+
+// Builds an alias table over the outcomes with the given (non-negative, not
+// all zero) weights, n columns starting at out.
+void BuildAliasTable(const double *weights, const uint32_t *outcomes, uint32_t n, AliasColumn *out)
+{
+    double total = 0;
+    for (uint32_t i = 0; i < n; ++i) total += weights[i];
+
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (uint32_t i = 0; i < n; ++i) {
+        scaled[i] = weights[i] * n / total;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back();
+        small.pop_back();
+        uint32_t l = large.back();
+        out[s].prob = scaled[s];
+        out[s].outcome = outcomes[s];
+        out[s].alias = outcomes[l];
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
         }
-        patterns.push_back(p);
     }
+    // What's left is 1 up to rounding.
+    for (uint32_t i : small) out[i] = { 1, outcomes[i], outcomes[i] };
+    for (uint32_t i : large) out[i] = { 1, outcomes[i], outcomes[i] };
+}
+
+uint32_t SampleAlias(const AliasColumn *columns, uint32_t n)
+{
+    const AliasColumn &c = columns[std::uniform_int_distribution<uint32_t>(0, n - 1)(rng)];
+    return std::uniform_real_distribution<float>(0, 1)(rng) < c.prob ? c.outcome : c.alias;
+}
 
-    if (patterns.empty()) failAny("expected at least one pattern");
+struct PatternTransition
+{
+    uint32_t from;
+    uint32_t to;
+    double weight;
+};
 
-    if (fclose(f)) failAny("fclose");
+void BuildPatternSelection(PatternLibrary &lib, const std::vector<double> &weights, std::vector<PatternTransition> &transitions)
+{
+    std::vector<uint32_t> outcomes(lib.npatterns);
+    for (uint32_t i = 0; i < lib.npatterns; ++i) outcomes[i] = i;
+    lib.selectStorage.resize(lib.npatterns);
+    BuildAliasTable(weights.data(), outcomes.data(), lib.npatterns, lib.selectStorage.data());
+
+    std::stable_sort(transitions.begin(), transitions.end(),
+        [](const PatternTransition &a, const PatternTransition &b) { return a.from < b.from; });
+
+    lib.transitionSpanStorage.assign(lib.npatterns, PatternSpan { 0, 0 });
+    lib.transitionColumnStorage.resize(transitions.size());
+    std::vector<double> w;
+    for (size_t i = 0; i < transitions.size(); ) {
+        size_t j = i;
+        w.clear();
+        outcomes.clear();
+        for (; j < transitions.size() && transitions[j].from == transitions[i].from; ++j) {
+            w.push_back(transitions[j].weight);
+            outcomes.push_back(transitions[j].to);
+        }
+        lib.transitionSpanStorage[transitions[i].from] = { static_cast<uint32_t>(i), static_cast<uint32_t>(j - i) };
+        BuildAliasTable(w.data(), outcomes.data(), j - i, &lib.transitionColumnStorage[i]);
+        i = j;
+    }
+
+    lib.ntransitionColumns = transitions.size();
+    lib.select = lib.selectStorage.data();
+    lib.transitionSpans = lib.transitionSpanStorage.data();
+    lib.transitionColumns = lib.transitionColumnStorage.data();
 }
 
-// Precompute quantities needed to render quickly
-int laneAt[HEIGHT][WIDTH];
-double distAt[HEIGHT][WIDTH];
-int bandNumAt[HEIGHT][WIDTH];
-void Precompute()
+// Whitespace-separated tokens of a pattern file held in memory.
+struct PatternTokens
 {
-    for (int y = 0; y < HEIGHT; ++y) {
-        for (int x = 0; x < WIDTH; ++x) {
-            double dx = x - (WIDTH - 1) / 2.0;
-            double dy = y - (HEIGHT - 1) / 2.0;
+    const char *p;
+    const char *end;
+    // Start of the last token read, or where one was expected; errors are
+    // reported there.
+    const char *last;
 
-            // Angles are clockwise of straight up
-            double theta = atan2(dx, dy) + M_PI;
-            int wedge = static_cast<int>(theta / (M_PI / nlanes));
-            int lane = ((wedge + 1) % (2 * nlanes)) / 2;
-            laneAt[y][x] = lane;
+    bool Next(std::string &token)
+    {
+        while (p < end && isspace(static_cast<unsigned char>(*p))) ++p;
+        last = p;
+        if (p == end) return false;
+        const char *start = p;
+        while (p < end && !isspace(static_cast<unsigned char>(*p))) ++p;
+        token.assign(start, p);
+        return true;
+    }
+};
 
-            double rho = lane * (2.0 * M_PI / nlanes);
-            double laneDX = -sin(rho);
-            double laneDY = -cos(rho);
+// A token of digits only, no more than max.
+bool ParseCount(const std::string &token, long long max, long long &out)
+{
+    if (token.empty()) return false;
+    out = 0;
+    for (char c : token) {
+        if (c < '0' || '9' < c) return false;
+        out = out * 10 + (c - '0');
+        if (out > max) return false;
+    }
+    return true;
+}
 
-            // Distance down this lane
-            double dist = laneDX * dx + laneDY * dy;
-            distAt[y][x] = dist;
+bool ParseWeight(const std::string &token, double &out)
+{
+    char *end;
+    out = strtod(token.c_str(), &end);
+    return !token.empty() && *end == 0 && std::isfinite(out) && out >= 0;
+}
 
-            const int INNER_BORDER = INNER_SPREAD + BORDER_SIZE;
-            bandNumAt[y][x] = 0;
-            if (dist >= INNER_BORDER) {
-                double outerDist = dist - INNER_BORDER;
-                bandNumAt[y][x] = static_cast<int>(outerDist / BAND_SIZE);
+// The loaders return NULL on success or a description of what was wrong, so
+// that a bad edit during hot reload doesn't take the game down.
+const char *ParsePatternText(PatternTokens &in, PatternLibrary &lib)
+{
+    std::string token;
+    long long value;
+
+    if (!in.Next(token) || !ParseCount(token, INT32_MAX, value)) return "could not read number of lanes";
+    if (value < LANES_MIN || LANES_MAX < value) return "number of lanes out of bounds";
+    lib.nlanes = value;
+
+    std::vector<double> weights;
+    double totalWeight = 0;
+    while (true) {
+        if (!in.Next(token) || !ParseCount(token, INT32_MAX, value)) return "could not read pattern length";
+        if (value == 0) break;
+        uint32_t plen = value;
+
+        // An optional weight follows the length.
+        double weight = 1;
+        PatternTokens peek = in;
+        if (peek.Next(token) && token == "weight") {
+            if (!peek.Next(token) || !ParseWeight(token, weight)) {
+                in.last = peek.last;
+                return "pattern weight must be a number, at least 0";
+            }
+            in = peek;
+        }
+        weights.push_back(weight);
+        totalWeight += weight;
+
+        PatternSpan span = { static_cast<uint32_t>(lib.rowStorage.size()), plen };
+        for (uint32_t j = 0; j < plen; ++j) {
+            if (!in.Next(token)) return "could not read pattern row";
+            if (token.size() != static_cast<size_t>(lib.nlanes)) return "incorrect length of pattern row";
+
+            PatternRow row = { 0, 0 };
+            for (int k = 0; k < lib.nlanes; ++k) {
+                if (token[k] == '#') row.walls |= 1 << k;
+                else if (token[k] == 'o') row.hurdles |= 1 << k;
             }
+            lib.rowStorage.push_back(row);
         }
+        lib.spanStorage.push_back(span);
+    }
+
+    if (lib.spanStorage.empty()) return "expected at least one pattern";
+    if (!(totalWeight > 0) || !std::isfinite(totalWeight)) return "pattern weights must add up to a positive number";
+
+    lib.npatterns = lib.spanStorage.size();
+    lib.nrows = lib.rowStorage.size();
+    lib.spans = lib.spanStorage.data();
+    lib.rows = lib.rowStorage.data();
+
+    // An optional transitions section follows the terminating 0: lines of
+    // "from to weight", with patterns numbered from 0 in file order.
+    // Anything else after the 0 is ignored.
+    std::vector<PatternTransition> transitions;
+    if (in.Next(token) && token == "transitions") {
+        while (in.Next(token)) {
+            PatternTransition t;
+            if (!ParseCount(token, lib.npatterns - 1, value)) return "transition names a pattern that doesn't exist";
+            t.from = value;
+            if (!in.Next(token) || !ParseCount(token, lib.npatterns - 1, value)) return "transition names a pattern that doesn't exist";
+            t.to = value;
+            if (!in.Next(token) || !ParseWeight(token, t.weight) || t.weight == 0) return "transition weight must be a positive number";
+            transitions.push_back(t);
+        }
+    }
+
+    BuildPatternSelection(lib, weights, transitions);
+    return NULL;
+}
+
+// Points the library into a pack image after checking that every span lies
+// inside it; the rows themselves are used as they are.
+const char *AttachPatternPack(PatternLibrary &lib, const void *data, size_t size)
+{
+    PackHeader h;
+    if (size < sizeof h) return "pattern pack is truncated";
+    memcpy(&h, data, sizeof h);
+    if (memcmp(h.magic, PACK_MAGIC, sizeof h.magic)) return "not a pattern pack";
+    if (h.version != PACK_VERSION) return "unsupported pattern pack version";
+    if (h.nlanes < LANES_MIN || LANES_MAX < h.nlanes) return "number of lanes out of bounds";
+    if (h.npatterns == 0) return "expected at least one pattern";
+
+    uint32_t ntransforms = 2 * h.nlanes;
+    uint64_t nindex = uint64_t(h.npatterns) * ntransforms;
+    uint64_t expected = sizeof h
+        + (uint64_t(h.npatterns) * 2 + h.nvariants) * sizeof(PatternSpan)
+        + nindex * sizeof(uint32_t)
+        + (uint64_t(h.npatterns) + h.ntransitionColumns) * sizeof(AliasColumn)
+        + (uint64_t(h.nrows) + h.nvariantRows) * sizeof(PatternRow);
+    if (size != expected) return "pattern pack has the wrong size";
+
+    const char *p = static_cast<const char *>(data) + sizeof h;
+    const PatternSpan *spans = reinterpret_cast<const PatternSpan *>(p);
+    p += h.npatterns * sizeof(PatternSpan);
+    const PatternSpan *variants = reinterpret_cast<const PatternSpan *>(p);
+    p += h.nvariants * sizeof(PatternSpan);
+    const uint32_t *variantOf = reinterpret_cast<const uint32_t *>(p);
+    p += nindex * sizeof(uint32_t);
+    const AliasColumn *select = reinterpret_cast<const AliasColumn *>(p);
+    p += h.npatterns * sizeof(AliasColumn);
+    const PatternSpan *transitionSpans = reinterpret_cast<const PatternSpan *>(p);
+    p += h.npatterns * sizeof(PatternSpan);
+    const AliasColumn *transitionColumns = reinterpret_cast<const AliasColumn *>(p);
+    p += h.ntransitionColumns * sizeof(AliasColumn);
+    const PatternRow *rows = reinterpret_cast<const PatternRow *>(p);
+    p += h.nrows * sizeof(PatternRow);
+    const PatternRow *variantRows = reinterpret_cast<const PatternRow *>(p);
+
+    for (uint32_t i = 0; i < h.npatterns; ++i) {
+        const PatternSpan &s = spans[i];
+        if (s.count == 0 || s.first > h.nrows || s.count > h.nrows - s.first) return "pattern pack span out of bounds";
+    }
+    for (uint32_t i = 0; i < h.nvariants; ++i) {
+        const PatternSpan &s = variants[i];
+        if (s.count == 0 || s.first > h.nvariantRows || s.count > h.nvariantRows - s.first) return "pattern pack variant out of bounds";
+    }
+    for (uint64_t i = 0; i < nindex; ++i) {
+        if (variantOf[i] >= h.nvariants) return "pattern pack variant index out of bounds";
+    }
+    for (uint32_t i = 0; i < h.npatterns; ++i) {
+        if (select[i].outcome >= h.npatterns || select[i].alias >= h.npatterns) return "pattern pack selection out of bounds";
+        const PatternSpan &s = transitionSpans[i];
+        if (s.first > h.ntransitionColumns || s.count > h.ntransitionColumns - s.first) return "pattern pack transitions out of bounds";
+    }
+    for (uint32_t i = 0; i < h.ntransitionColumns; ++i) {
+        const AliasColumn &c = transitionColumns[i];
+        if (c.outcome >= h.npatterns || c.alias >= h.npatterns) return "pattern pack transition out of bounds";
     }
+
+    lib.nlanes = h.nlanes;
+    lib.npatterns = h.npatterns;
+    lib.nrows = h.nrows;
+    lib.spans = spans;
+    lib.rows = rows;
+    lib.ntransforms = ntransforms;
+    lib.nvariants = h.nvariants;
+    lib.nvariantRows = h.nvariantRows;
+    lib.variants = variants;
+    lib.variantRows = variantRows;
+    lib.variantOf = variantOf;
+    lib.ntransitionColumns = h.ntransitionColumns;
+    lib.select = select;
+    lib.transitionSpans = transitionSpans;
+    lib.transitionColumns = transitionColumns;
+    return NULL;
 }
 
-void Restart()
+// Maps the file and attaches it if it starts with the pack magic. isPack is
+// left false, and nothing kept, for any other file.
+const char *LoadPatternPack(const char *path, PatternLibrary &lib, bool &isPack)
 {
-    ReadPatterns();
-    Precompute();
+    isPack = false;
+#ifdef DH_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return "could not open patterns";
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return "could not stat patterns";
+    }
+    size_t size = st.st_size;
+    if (size < sizeof PACK_MAGIC) {
+        close(fd);
+        return NULL;
+    }
 
-    for (int i = 0; i < LEVEL_LEN; ++i) {
-        for (int d = 0; d < nlanes; ++d) {
-            incoming[d][i] = BAND_TYPE_NONE;
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return "could not map patterns";
+    if (memcmp(p, PACK_MAGIC, sizeof PACK_MAGIC)) {
+        munmap(p, size);
+        return NULL;
+    }
+
+    isPack = true;
+    lib.mapping = p;
+    lib.mappingSize = size;
+    return AttachPatternPack(lib, p, size);
+#else
+    FILE *f = fopen(path, "rb");
+    if (!f) return "could not open patterns";
+    char magic[sizeof PACK_MAGIC];
+    if (fread(magic, 1, sizeof magic, f) != sizeof magic || memcmp(magic, PACK_MAGIC, sizeof magic)) {
+        fclose(f);
+        return NULL;
+    }
+
+    isPack = true;
+    long size = -1;
+    if (!fseek(f, 0, SEEK_END)) size = ftell(f);
+    rewind(f);
+    if (size < 0) {
+        fclose(f);
+        return "could not size patterns";
+    }
+
+    // uint32_t storage keeps the spans and rows aligned.
+    lib.packStorage.resize((size + 3) / 4);
+    bool readOk = fread(lib.packStorage.data(), 1, size, f) == static_cast<size_t>(size);
+    fclose(f);
+    if (!readOk) return "could not read patterns";
+    return AttachPatternPack(lib, lib.packStorage.data(), size);
+#endif
+}
+
+// Transform t puts lane k of a pattern on lane (t / 2 + dlane * k) mod n,
+// where dlane is -1 for even t and 1 for odd t. Masks are remapped a byte at
+// a time through a table of each transform's image of every byte.
+void BuildPatternVariants(PatternLibrary &lib)
+{
+    int n = lib.nlanes;
+    lib.ntransforms = 2 * n;
+
+    std::vector<uint16_t> byteImage(lib.ntransforms * 2 * 256);
+    for (int t = 0; t < lib.ntransforms; ++t) {
+        int lane0 = t / 2;
+        int dlane = t % 2 ? 1 : -1;
+        for (int half = 0; half < 2; ++half) {
+            uint16_t *image = &byteImage[(t * 2 + half) * 256];
+            for (int b = 1; b < 256; ++b) {
+                // Add the lowest set bit's image to that of the rest.
+                int j = 0;
+                while (!(b >> j & 1)) ++j;
+                int k = half * 8 + j;
+                image[b] = image[b & (b - 1)] | (k < n ? 1 << (lane0 + dlane * k + n) % n : 0);
+            }
         }
     }
 
-    int i = INTRO_LEN;
-    while (true) {
-        // Select random pattern, flip, and rotation
-        int type = rng() % patterns.size();
-        int lane0 = rng() % nlanes;
-        int dlane = -1 + 2 * (rng() % 2);
-
-        const Pattern &p = patterns[type];
-
-        if (i + p.rows.size() >= LEVEL_LEN) break;
-
-        for (auto row : p.rows) {
-            for (int k = 0; k < nlanes; ++k) {
-                int d = (lane0 + dlane * k + nlanes) % nlanes;
-                char c = row[k];
-                if (c == '#') {
-                    incoming[d][i] = BAND_TYPE_WALL;
-                } else if (c == 'o') {
-                    incoming[d][i] = BAND_TYPE_HURDLE;
+    std::vector<PatternSpan> &variants = lib.variantStorage;
+    std::vector<PatternRow> &rows = lib.variantRowStorage;
+    std::vector<uint32_t> &variantOf = lib.variantOfStorage;
+    variants.clear();
+    rows.clear();
+    variantOf.assign(lib.npatterns * lib.ntransforms, 0);
+    rows.reserve(lib.nrows * lib.ntransforms);
+
+    // Candidates for deduplication are compared by a cheap hash first.
+    std::vector<uint32_t> hashes(lib.ntransforms);
+    for (uint32_t p = 0; p < lib.npatterns; ++p) {
+        const PatternSpan &s = lib.spans[p];
+        uint32_t firstVariant = variants.size();
+        for (int t = 0; t < lib.ntransforms; ++t) {
+            const uint16_t *lo = &byteImage[(t * 2) * 256];
+            const uint16_t *hi = &byteImage[(t * 2 + 1) * 256];
+            PatternSpan v = { static_cast<uint32_t>(rows.size()), s.count };
+            uint32_t hash = 2166136261u;
+            for (uint32_t j = 0; j < s.count; ++j) {
+                const PatternRow &r = lib.rows[s.first + j];
+                PatternRow out;
+                out.walls = lo[r.walls & 0xFF] | hi[r.walls >> 8];
+                out.hurdles = lo[r.hurdles & 0xFF] | hi[r.hurdles >> 8];
+                rows.push_back(out);
+                hash = (hash ^ (out.walls | uint32_t(out.hurdles) << 16)) * 16777619u;
+            }
+
+            uint32_t match = variants.size();
+            for (uint32_t u = firstVariant; u < variants.size(); ++u) {
+                if (hashes[u - firstVariant] != hash) continue;
+                if (!memcmp(&rows[variants[u].first], &rows[v.first], s.count * sizeof(PatternRow))) {
+                    match = u;
+                    break;
                 }
             }
-            ++i;
+            if (match == variants.size()) {
+                hashes[match - firstVariant] = hash;
+                variants.push_back(v);
+            } else {
+                rows.resize(v.first);
+            }
+            variantOf[p * lib.ntransforms + t] = match;
         }
     }
 
-    offset = 0;
-    playerLane = 0;
-    playerAlive = true;
-    playerHurdling = false;
-    
-    // Anything big is fine.
-    timeSinceAdvance_ms = 1000;
+    lib.nvariants = variants.size();
+    lib.nvariantRows = rows.size();
+    lib.variants = variants.data();
+    lib.variantRows = rows.data();
+    lib.variantOf = variantOf.data();
 }
 
-int GetIncomingBandType(int lane, int bandNum)
+// Reads a whole file into text; returns false if it can't.
+bool ReadWholeFile(const char *path, std::string &text)
 {
-    bandNum += offset;
-    if (bandNum < 0 || LEVEL_LEN <= bandNum) return BAND_TYPE_NONE;
-    return incoming[lane][bandNum];
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    char buf[4096];
+    size_t got;
+    text.clear();
+    while ((got = fread(buf, 1, sizeof buf, f)) > 0) text.append(buf, got);
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
 }
 
-bool IsBandPlayer(int lane, int bandNum)
+// Parses the text format, giving the line and column of any error.
+bool LoadPatternText(const char *text, size_t size, PatternLibrary &lib, LoadError &err)
 {
-    return lane == playerLane && bandNum == 0;
+    PatternTokens in = { text, text + size, text };
+    const char *reason = ParsePatternText(in, lib);
+    if (!reason) {
+        BuildPatternVariants(lib);
+        return true;
+    }
+
+    err.line = 1;
+    const char *lineStart = text;
+    for (const char *c = text; c < in.last; ++c) {
+        if (*c == '\n') {
+            ++err.line;
+            lineStart = c + 1;
+        }
+    }
+    err.column = in.last - lineStart + 1;
+    err.reason = reason;
+    return false;
 }
 
-bool BandHalfParity(int bandNum)
+// Loads either a compiled pack or the text format, told apart by the magic.
+// Returns NULL and sets err on failure.
+std::shared_ptr<const PatternLibrary> ReadPatterns(const char *path, LoadError &err)
 {
-    return ((offset + bandNum) / 2) % 2;
+    err.file = path;
+    err.line = err.column = 0;
+
+    std::shared_ptr<PatternLibrary> lib = std::make_shared<PatternLibrary>();
+    bool isPack;
+    const char *reason = LoadPatternPack(path, *lib, isPack);
+    if (!reason && !isPack) {
+        std::string text;
+        if (!ReadWholeFile(path, text)) reason = "could not read patterns";
+        else if (!LoadPatternText(text.data(), text.size(), *lib, err)) return NULL;
+    }
+    if (reason) {
+        err.reason = reason;
+        return NULL;
+    }
+    return lib;
 }
 
-void CheckCollision()
+// The same from a file already in memory, at any alignment; a pack is
+// copied so that its tables are aligned. Leaves err.file alone.
+bool LoadPatternsFromMemory(const void *data, size_t size, PatternLibrary &lib, LoadError &err)
 {
-    int t = GetIncomingBandType(playerLane, 0);
-    if (t == BAND_TYPE_WALL ||
-            (t == BAND_TYPE_HURDLE && !playerHurdling) ||
-            (t == BAND_TYPE_NONE && playerHurdling)) {
-        playerAlive = false;
+    err.line = err.column = 0;
+    if (size >= sizeof PACK_MAGIC && !memcmp(data, PACK_MAGIC, sizeof PACK_MAGIC)) {
+        lib.packStorage.resize((size + 3) / 4);
+        memcpy(lib.packStorage.data(), data, size);
+        const char *reason = AttachPatternPack(lib, lib.packStorage.data(), size);
+        if (reason) err.reason = reason;
+        return !reason;
     }
+    return LoadPatternText(static_cast<const char *>(data), size, lib, err);
 }
 
-void Advance()
+// Writes to a temporary file and renames it into place, so that a running
+// game with the old pack mapped keeps its copy.
+void WritePatternPack(const PatternLibrary &lib, const char *path)
 {
-    timeSinceAdvance_ms = 0;
-    ++offset;
-    CheckCollision();
-    playerHurdling = false;
+    PackHeader h;
+    memcpy(h.magic, PACK_MAGIC, sizeof h.magic);
+    h.version = PACK_VERSION;
+    h.nlanes = lib.nlanes;
+    h.npatterns = lib.npatterns;
+    h.nrows = lib.nrows;
+    h.nvariants = lib.nvariants;
+    h.nvariantRows = lib.nvariantRows;
+    h.ntransitionColumns = lib.ntransitionColumns;
+
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE *f = fopen(tmpPath.c_str(), "wb");
+    if (!f) failAny("fopen pattern pack for writing");
+    if (fwrite(&h, sizeof h, 1, f) != 1) failAny("fwrite pattern pack");
+    size_t nindex = size_t(lib.npatterns) * lib.ntransforms;
+    if (fwrite(lib.spans, sizeof(PatternSpan), lib.npatterns, f) != lib.npatterns) failAny("fwrite pattern pack");
+    if (fwrite(lib.variants, sizeof(PatternSpan), lib.nvariants, f) != lib.nvariants) failAny("fwrite pattern pack");
+    if (fwrite(lib.variantOf, sizeof(uint32_t), nindex, f) != nindex) failAny("fwrite pattern pack");
+    if (fwrite(lib.select, sizeof(AliasColumn), lib.npatterns, f) != lib.npatterns) failAny("fwrite pattern pack");
+    if (fwrite(lib.transitionSpans, sizeof(PatternSpan), lib.npatterns, f) != lib.npatterns) failAny("fwrite pattern pack");
+    if (lib.ntransitionColumns && fwrite(lib.transitionColumns, sizeof(AliasColumn), lib.ntransitionColumns, f) != lib.ntransitionColumns) failAny("fwrite pattern pack");
+    if (lib.nrows && fwrite(lib.rows, sizeof(PatternRow), lib.nrows, f) != lib.nrows) failAny("fwrite pattern pack");
+    if (fwrite(lib.variantRows, sizeof(PatternRow), lib.nvariantRows, f) != lib.nvariantRows) failAny("fwrite pattern pack");
+    if (fclose(f)) failAny("fclose");
+#ifdef _WIN32
+    remove(path);
+#endif
+    if (rename(tmpPath.c_str(), path)) failAny("rename pattern pack into place");
 }
 
-const double ANIM_PER_SEC = 240.0;
-const double ANIM_PER_MS = ANIM_PER_SEC / 1000.0;
+// --compile-patterns: convert a pattern file into a pack and exit.
+const char *compileIn = NULL;
+const char *compileOut = NULL;
 
-void DrawText(const char *s, SDL_Color color, int x, int y, int *textW, int *textH, bool center = false)
+void CompilePatterns()
 {
-    int tW, tH;
-    if (textW == NULL) textW = &tW;
-    if (textH == NULL) textH = &tH;
+    LoadError err;
+    std::shared_ptr<const PatternLibrary> lib = ReadPatterns(compileIn, err);
+    if (!lib) failAny(DescribeLoadError(err).c_str());
+    WritePatternPack(*lib, compileOut);
+    std::printf("Wrote %s: %d lanes, %u patterns (%u distinct with rotations and flips), %u rows\n",
+        compileOut, lib->nlanes, lib->npatterns, lib->nvariants, lib->nrows);
+}
 
-    sdl_ptr<SDL_Surface> textSurf(TTF_RenderText_Solid(font, s, color));
-    if (!textSurf) failTTF("TTF_RenderText_Solid");
+void RequestGeometry(int n);
 
-    sdl_ptr<SDL_Texture> textTex(SDL_CreateTextureFromSurface(ren, textSurf.get()));
-    if (!textTex) failSDL("SDL_CreateTextureFromSurface");
+// The libraries in use, one per pattern file, each read once at startup and
+// swapped whole by the watcher; always accessed through std::atomic_load and
+// std::atomic_store.
+std::shared_ptr<const PatternLibrary> patternLibs[PATTERN_FILES_MAX];
 
-    if (SDL_QueryTexture(textTex.get(), NULL, NULL, textW, textH) < 0) failSDL("SDL_QueryTexture");
+std::shared_ptr<const PatternLibrary> Patterns(int file)
+{
+    return std::atomic_load(&patternLibs[file]);
+}
 
-    if (center) {
-        x -= *textW / 2;
-        y -= *textH / 2;
+// The main pattern file's, which the headless tools use.
+std::shared_ptr<const PatternLibrary> CurrentPatterns()
+{
+    return Patterns(0);
+}
+
+// Returns false and sets err at the first file that fails.
+bool LoadPatterns(LoadError &err)
+{
+    for (int i = 0; i < PatternFileCount(); ++i) {
+        std::shared_ptr<const PatternLibrary> lib = ReadPatterns(PatternFilePath(i), err);
+        if (!lib) return false;
+        std::atomic_store(&patternLibs[i], lib);
     }
+    return true;
+}
 
-    SDL_Rect dst = { x, y, *textW, *textH };
-    if (SDL_RenderCopy(ren, textTex.get(), NULL, &dst) < 0) failSDL("SDL_RenderCopy");
+void LoadPatterns()
+{
+    LoadError err;
+    if (!LoadPatterns(err)) failAny(DescribeLoadError(err).c_str());
 }
 
-const uint32_t DARK_RED = 0x471205FF;
-const uint32_t MEDIUM_RED = 0x6A1A07FF;
-const uint32_t LIGHT_RED = 0xC1161EFF;
-const uint32_t VERY_LIGHT_RED = 0xFF7780FF;
+void ReloadPatterns(int file)
+{
+    const char *path = PatternFilePath(file);
+    LoadError err;
+    std::shared_ptr<const PatternLibrary> lib = ReadPatterns(path, err);
+    if (!lib) {
+        std::printf("%s; keeping the previous patterns\n", DescribeLoadError(err).c_str());
+        return;
+    }
+    RequestGeometry(lib->nlanes);
+    std::atomic_store(&patternLibs[file], lib);
+    std::printf("Reloaded %u patterns from %s; they take effect on restart\n", lib->npatterns, path);
+}
 
-const uint32_t LIGHT_GREEN = 0x1fc116FF;
+// Hot reload: a background thread reparses the pattern file whenever it
+// changes on disk.
+const int PATTERN_POLL_MS = 250;
+// Editors often save in several steps; wait for them to settle.
+const int PATTERN_SETTLE_MS = 50;
 
-void update()
+#ifdef DH_THREADS
+std::thread patternWatchThread;
+std::atomic<bool> patternWatchQuit(false);
+
+#ifdef DH_INOTIFY
+// Watches the containing directories rather than the files, since many
+// editors save by renaming a new file over the old one.
+bool WatchPatternsInotify()
 {
-    SDL_Event e;
-    while (SDL_PollEvent(&e)) {
-        if (e.type == SDL_QUIT) {
-            quitRequested = true;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return false;
+
+    int nfiles = PatternFileCount();
+    int wds[PATTERN_FILES_MAX];
+    std::string names[PATTERN_FILES_MAX];
+    for (int i = 0; i < nfiles; ++i) {
+        std::string path = PatternFilePath(i);
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+        names[i] = slash == std::string::npos ? path : path.substr(slash + 1);
+
+        // Watching a directory again gives the same descriptor.
+        wds[i] = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wds[i] < 0) {
+            close(fd);
+            return false;
         }
-        
-        if (e.type == SDL_KEYDOWN) {
-            if (e.key.keysym.sym == SDLK_BACKSPACE) {
-                Restart();
-            }
-
-            if (playerAlive) {
-                if (e.key.keysym.sym == SDLK_LEFT || e.key.keysym.sym == SDLK_s) {
-                    playerLane = (playerLane + 1) % nlanes;
-                    Advance();
-                }
-
-                if (e.key.keysym.sym == SDLK_RIGHT || e.key.keysym.sym == SDLK_f) {
-                    playerLane = (playerLane + nlanes - 1) % nlanes;
-                    Advance();
-                }
+    }
 
-                if (e.key.keysym.sym == SDLK_UP || e.key.keysym.sym == SDLK_e) {
-                    Advance();
-                }
+    // Bitmask of the files that changed.
+    unsigned pending = 0;
+    while (!patternWatchQuit.load()) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, pending ? PATTERN_SETTLE_MS : PATTERN_POLL_MS);
+        if (ready <= 0) {
+            for (int i = 0; i < nfiles; ++i) {
+                if (pending >> i & 1) ReloadPatterns(i);
+            }
+            pending = 0;
+            continue;
+        }
 
-                if (e.key.keysym.sym == SDLK_DOWN || e.key.keysym.sym == SDLK_d) {
-                    playerHurdling = true;
-                    Advance();
+        alignas(inotify_event) char buf[4096];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof buf)) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                const inotify_event *ev = reinterpret_cast<const inotify_event *>(p);
+                for (int i = 0; i < nfiles && ev->len; ++i) {
+                    if (ev->wd == wds[i] && names[i] == ev->name) pending |= 1u << i;
                 }
+                p += sizeof(inotify_event) + ev->len;
             }
         }
     }
-}
 
-uint32_t * pixels;
-int pitch;
+    close(fd);
+    return true;
+}
+#endif
 
-void render()
+bool PatternFileStamp(int file, struct stat &st)
 {
-    // Draw
-    for (int y = 0; y < HEIGHT; ++y) {
-        for (int x = 0; x < WIDTH; ++x) {
-            int lane = laneAt[y][x];
-            double dist = distAt[y][x];
-
-            uint32_t color = lane % 2 ? DARK_RED : MEDIUM_RED;
-
-            const int INNER_BORDER = INNER_SPREAD + BORDER_SIZE;
-            if (dist < INNER_SPREAD) {
-                color = DARK_RED;
-            } else if (dist < INNER_BORDER) {
-                color = LIGHT_RED;
-            } else {
-                double outerDist = dist - INNER_BORDER;
-                int bandNum = bandNumAt[y][x];
-                double inBandDist = outerDist - BAND_SIZE * bandNum;
-
-                for (int dband = 0; dband <= 1; ++dband) {
-                    int t = GetIncomingBandType(lane, bandNum - dband);
-                    if (t != BAND_TYPE_NONE) {
-                        uint32_t bandColor = LIGHT_RED;
-                        if (t == BAND_TYPE_HURDLE) bandColor = LIGHT_GREEN;
-
-                        int thickness = GetIncomingBandType(lane, bandNum + 1 - dband) == t ? BAND_SIZE : BAND_THICKNESS;
-                        int tween = std::max(BAND_SIZE - static_cast<int>(round(ANIM_PER_MS * timeSinceAdvance_ms)), 0);
-                        if (inBandDist + dband * BAND_SIZE < thickness + tween && inBandDist + dband * BAND_SIZE >= tween) color = bandColor;
-                    }
-                }
+    return !stat(PatternFilePath(file), &st);
+}
 
-                if (IsBandPlayer(lane, bandNum) && inBandDist >= BAND_SIZE - BAND_THICKNESS) {
-                    color = VERY_LIGHT_RED;
-                }
+void WatchPatternsPolling()
+{
+    int nfiles = PatternFileCount();
+    struct stat last[PATTERN_FILES_MAX];
+    bool haveLast[PATTERN_FILES_MAX];
+    for (int i = 0; i < nfiles; ++i) haveLast[i] = PatternFileStamp(i, last[i]);
+    while (!patternWatchQuit.load()) {
+        SDL_Delay(PATTERN_POLL_MS);
+        for (int i = 0; i < nfiles; ++i) {
+            struct stat now;
+            if (!PatternFileStamp(i, now)) continue;
+            if (!haveLast[i] || now.st_mtime != last[i].st_mtime || now.st_size != last[i].st_size) {
+                SDL_Delay(PATTERN_SETTLE_MS);
+                ReloadPatterns(i);
+                PatternFileStamp(i, now);
             }
-
-            pixels[y*WIDTH + x] = color;
+            last[i] = now;
+            haveLast[i] = true;
         }
     }
+}
 
-    SDL_UpdateTexture(canvas.get(), NULL, pixels, pitch);
+void PatternWatchThread()
+{
+#ifdef DH_INOTIFY
+    if (WatchPatternsInotify()) return;
+#endif
+    WatchPatternsPolling();
+}
+#endif
 
-    if (SDL_RenderCopy(ren, canvas.get(), NULL, NULL) < 0) failSDL("SDL_RenderCopy canvas");
+void StartPatternWatch()
+{
+#ifdef DH_THREADS
+    patternWatchThread = std::thread(PatternWatchThread);
+#endif
+}
 
-    if (!playerAlive) {
-        DrawText("YOU DIED", { 255, 255, 255, 255 }, WIDTH / 2, HEIGHT / 2, NULL, NULL, true);
+void StopPatternWatch()
+{
+#ifdef DH_THREADS
+    if (patternWatchThread.joinable()) {
+        patternWatchQuit.store(true);
+        patternWatchThread.join();
     }
+#endif
+}
 
-    if (renderAvgDenom > 0) {
-        char buf[256];
-        snprintf(buf, sizeof(buf), "Render avg: %.2lf ms", renderAvgTime_ms / renderAvgDenom);
+// For the rotating camera: the angle of each pixel clockwise of straight up,
+// in 1/65536ths of a turn, and its distance from the centre. These don't
+// depend on the number of lanes, so they are computed once at startup. With
+// the camera angle subtracted, the integer part of angle * nlanes picks the
+// lane and the fraction indexes tables of the lane-relative trigonometry.
+uint16_t angleAt[HEIGHT][WIDTH];
+float radiusAt[HEIGHT][WIDTH];
+const int LANE_FRAC_BITS = 12;
+const int LANE_FRAC_LEN = 1 << LANE_FRAC_BITS;
+
+// For anti-aliasing, pixels this close to a lane boundary are flagged.
+const double LANE_EDGE_FLAG_DIST = 0.5 / RENDER_SCALE_MIN;
+
+// Precompute quantities needed to render quickly, for one lane count.
+struct Geometry
+{
+    int nlanes;
+    int laneAt[HEIGHT][WIDTH];
+    double distAt[HEIGHT][WIDTH];
+    int bandNumAt[HEIGHT][WIDTH];
+
+    // For anti-aliasing: pixels near a lane boundary are flagged with the
+    // lane on the other side (-1 elsewhere), the distance down that lane,
+    // and the distance from the pixel centre to the boundary.
+    int neighborLaneAt[HEIGHT][WIDTH];
+    double neighborDistAt[HEIGHT][WIDTH];
+    float laneEdgeDistAt[HEIGHT][WIDTH];
+
+    // For the rotating camera, indexed by position across a lane, with the
+    // lane centre at LANE_FRAC_LEN / 2.
+    float laneCosAt[LANE_FRAC_LEN];
+    float laneEdgeSinAt[LANE_FRAC_LEN];
+    float neighborCosAt[LANE_FRAC_LEN];
+};
+
+// The tables being drawn with and their lane count. Only FetchState()
+// changes them.
+std::shared_ptr<const Geometry> geometry;
+int nlanes;
+
+void PrecomputeAngles()
+{
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            double dx = x - (WIDTH - 1) / 2.0;
+            double dy = y - (HEIGHT - 1) / 2.0;
+
+            double theta = atan2(dx, dy) + M_PI;
+            angleAt[y][x] = static_cast<uint16_t>(static_cast<uint32_t>(round(theta / (2.0 * M_PI) * 65536.0)));
+            radiusAt[y][x] = static_cast<float>(hypot(dx, dy));
+        }
+    }
+}
+
+void PrecomputeLaneFractions(Geometry &g)
+{
+    double wedge = 2.0 * M_PI / g.nlanes;
+    for (int i = 0; i < LANE_FRAC_LEN; ++i) {
+        double dtheta = ((i + 0.5) / LANE_FRAC_LEN - 0.5) * wedge;
+        g.laneCosAt[i] = static_cast<float>(cos(dtheta));
+        g.laneEdgeSinAt[i] = static_cast<float>(sin(wedge / 2 - fabs(dtheta)));
+        g.neighborCosAt[i] = static_cast<float>(cos(wedge - fabs(dtheta)));
+    }
+}
+
+std::shared_ptr<const Geometry> Precompute(int n)
+{
+    std::shared_ptr<Geometry> g = std::make_shared<Geometry>();
+    g->nlanes = n;
+    PrecomputeLaneFractions(*g);
+
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            double dx = x - (WIDTH - 1) / 2.0;
+            double dy = y - (HEIGHT - 1) / 2.0;
+
+            // Angles are clockwise of straight up
+            double theta = atan2(dx, dy) + M_PI;
+            int wedge = static_cast<int>(theta / (M_PI / n));
+            int lane = ((wedge + 1) % (2 * n)) / 2;
+            g->laneAt[y][x] = lane;
+
+            double rho = lane * (2.0 * M_PI / n);
+            double laneDX = -sin(rho);
+            double laneDY = -cos(rho);
+
+            // Distance down this lane
+            double dist = laneDX * dx + laneDY * dy;
+            g->distAt[y][x] = dist;
+
+            double halfWedge = M_PI / n;
+            double dtheta = remainder(theta - rho, 2.0 * M_PI);
+            double edgeDist = hypot(dx, dy) * sin(halfWedge - fabs(dtheta));
+            g->laneEdgeDistAt[y][x] = static_cast<float>(edgeDist);
+            g->neighborLaneAt[y][x] = -1;
+            if (edgeDist < LANE_EDGE_FLAG_DIST) {
+                int neighbor = (lane + (dtheta > 0 ? 1 : n - 1)) % n;
+                double neighborRho = neighbor * (2.0 * M_PI / n);
+                g->neighborLaneAt[y][x] = neighbor;
+                g->neighborDistAt[y][x] = -sin(neighborRho) * dx - cos(neighborRho) * dy;
+            }
+
+            const int INNER_BORDER = INNER_SPREAD + BORDER_SIZE;
+            g->bandNumAt[y][x] = 0;
+            if (dist >= INNER_BORDER) {
+                double outerDist = dist - INNER_BORDER;
+                g->bandNumAt[y][x] = static_cast<int>(outerDist / BAND_SIZE);
+            }
+        }
+    }
+    return g;
+}
+
+// Tables by lane count. A worker thread builds them for every pattern file
+// as it loads, so switching lane counts mid-session doesn't stall a frame.
+// Accessed through std::atomic_load and std::atomic_store.
+std::shared_ptr<const Geometry> geometryCache[LANES_MAX + 1];
+// Bitmask of lane counts asked for.
+std::atomic<uint32_t> geometryWanted(0);
+
+#ifdef DH_THREADS
+std::thread geometryThread;
+SDL_sem *geometryWake = NULL;
+std::atomic<bool> geometryQuit(false);
+#endif
+
+void BuildWantedGeometry()
+{
+    uint32_t wanted = geometryWanted.exchange(0);
+    for (int n = LANES_MIN; n <= LANES_MAX; ++n) {
+        if ((wanted >> n & 1) && !std::atomic_load(&geometryCache[n])) {
+            std::atomic_store(&geometryCache[n], Precompute(n));
+        }
+    }
+}
+
+#ifdef DH_THREADS
+void GeometryThread()
+{
+    while (true) {
+        SDL_SemWait(geometryWake);
+        if (geometryQuit.load()) break;
+        BuildWantedGeometry();
+    }
+}
+#endif
+
+// Queues the tables for n lanes to be built in the background. Without the
+// worker (headless, or no threads) nothing happens until it starts.
+void RequestGeometry(int n)
+{
+    geometryWanted.fetch_or(1u << n);
+#ifdef DH_THREADS
+    if (geometryWake) SDL_SemPost(geometryWake);
+#endif
+}
+
+// Starts on the lane counts of every loaded pattern file. Without threads
+// they are built here instead, still ahead of play.
+void StartGeometryWorker()
+{
+    for (int i = 0; i < PatternFileCount(); ++i) RequestGeometry(Patterns(i)->nlanes);
+#ifdef DH_THREADS
+    geometryWake = SDL_CreateSemaphore(1);
+    if (!geometryWake) failSDL("SDL_CreateSemaphore");
+    geometryThread = std::thread(GeometryThread);
+#else
+    BuildWantedGeometry();
+#endif
+}
+
+void StopGeometryWorker()
+{
+#ifdef DH_THREADS
+    if (geometryThread.joinable()) {
+        geometryQuit.store(true);
+        SDL_SemPost(geometryWake);
+        geometryThread.join();
+    }
+    if (geometryWake) {
+        SDL_DestroySemaphore(geometryWake);
+        geometryWake = NULL;
+    }
+#endif
+}
+
+// The tables for n lanes, built here if the worker hasn't got to them.
+std::shared_ptr<const Geometry> GetGeometry(int n)
+{
+    std::shared_ptr<const Geometry> g = std::atomic_load(&geometryCache[n]);
+    if (!g) {
+        g = Precompute(n);
+        std::atomic_store(&geometryCache[n], g);
+    }
+    return g;
+}
+
+// Music playback. The whole file is decoded and converted to the device
+// format at load, so the audio callback only copies samples; it shares only
+// atomics with the other threads and never allocates or locks.
+const char *musicPath = NULL;
+int audioBufferFrames = 512;
+SDL_AudioDeviceID audioDevice = 0;
+SDL_AudioSpec audioSpec;
+Sint16 *musicSamples = NULL;
+size_t musicFrames = 0;
+std::atomic<size_t> musicPos(0);
+std::atomic<bool> musicRewind(false);
+// Performance counter when the first sample reaches the output, or 0 while
+// a rewind is pending.
+std::atomic<Uint64> musicOrigin(0);
+
+void AudioCallback(void *, Uint8 *stream, int len)
+{
+    int channels = audioSpec.channels;
+    size_t frames = len / (sizeof(Sint16) * channels);
+    size_t pos = musicPos.load(std::memory_order_relaxed);
+
+    if (musicRewind.exchange(false)) {
+        pos = 0;
+        // What is written now plays once the buffer ahead of it drains.
+        Uint64 delay = SDL_GetPerformanceFrequency() * audioSpec.samples / audioSpec.freq;
+        musicOrigin.store(SDL_GetPerformanceCounter() + delay);
+    }
+
+    size_t n = pos < musicFrames ? std::min(frames, musicFrames - pos) : 0;
+    size_t bytes = n * channels * sizeof(Sint16);
+    memcpy(stream, musicSamples + pos * channels, bytes);
+    memset(stream + bytes, 0, len - bytes);
+    musicPos.store(pos + n, std::memory_order_relaxed);
+}
+
+// Start the music from the beginning. The new origin is stamped by the
+// audio callback when it actually rewinds.
+void RestartMusic()
+{
+    musicOrigin.store(0);
+    musicRewind.store(true);
+}
+
+void LoadMusic()
+{
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) failSDL("SDL_InitSubSystem audio");
+
+    SDL_AudioSpec wavSpec;
+    Uint8 *wavBuf;
+    Uint32 wavLen;
+    if (!SDL_LoadWAV(musicPath, &wavSpec, &wavBuf, &wavLen)) failSDL("SDL_LoadWAV");
+
+    SDL_AudioSpec want;
+    memset(&want, 0, sizeof(want));
+    want.freq = wavSpec.freq;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = static_cast<Uint16>(audioBufferFrames);
+    want.callback = AudioCallback;
+
+    // No allowed changes: SDL converts from this to whatever the hardware
+    // wants, so the callback can always copy.
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &audioSpec, 0);
+    if (!audioDevice) failSDL("SDL_OpenAudioDevice");
+
+    SDL_AudioCVT cvt;
+    if (SDL_BuildAudioCVT(&cvt, wavSpec.format, wavSpec.channels, wavSpec.freq,
+            audioSpec.format, audioSpec.channels, audioSpec.freq) < 0) {
+        failSDL("SDL_BuildAudioCVT");
+    }
+    cvt.len = static_cast<int>(wavLen);
+    cvt.buf = static_cast<Uint8 *>(SDL_malloc(wavLen * cvt.len_mult));
+    if (!cvt.buf) failAny("out of memory for music");
+    memcpy(cvt.buf, wavBuf, wavLen);
+    SDL_FreeWAV(wavBuf);
+    if (cvt.needed && SDL_ConvertAudio(&cvt) < 0) failSDL("SDL_ConvertAudio");
+
+    musicSamples = reinterpret_cast<Sint16 *>(cvt.buf);
+    musicFrames = (cvt.needed ? cvt.len_cvt : cvt.len) / (sizeof(Sint16) * audioSpec.channels);
+    printf("Music: %.1f s at %d Hz, %d frame buffer\n",
+        static_cast<double>(musicFrames) / audioSpec.freq, audioSpec.freq, audioSpec.samples);
+}
+
+void StartMusic()
+{
+    RestartMusic();
+    SDL_PauseAudioDevice(audioDevice, 0);
+}
+
+void StopMusic()
+{
+    if (audioDevice) SDL_CloseAudioDevice(audioDevice);
+    audioDevice = 0;
+    SDL_free(musicSamples);
+    musicSamples = NULL;
+}
+
+// Offline beat tracking, for music without a beat clock file. The onset
+// envelope is the rise in log energy of the high-passed mono signal, sampled
+// every ONSET_HOP_MS. Tempo is the autocorrelation peak of the envelope,
+// weighted towards ~120 bpm to avoid picking double or half time, and the
+// phase is the offset whose comb of beats collects the most onset strength.
+const double ONSET_HOP_MS = 5.0;
+const double DETECT_BPM_MIN = 60;
+const double DETECT_BPM_MAX = 200;
+
+std::atomic<bool> beatDetectDone(false);
+double detectedBpm;
+double detectedOffset_ms;
+#ifdef DH_THREADS
+std::thread beatDetectThread;
+#endif
+
+void DetectBeats()
+{
+    int channels = audioSpec.channels;
+    size_t hop = std::max<size_t>(1, static_cast<size_t>(audioSpec.freq * ONSET_HOP_MS / 1000.0));
+    size_t nhops = musicFrames / hop;
+    // Envelope samples per second.
+    double rate = static_cast<double>(audioSpec.freq) / hop;
+
+    std::vector<double> onset(nhops, 0.0);
+    double prevSample = 0;
+    double prevLogEnergy = 0;
+    for (size_t i = 0; i < nhops; ++i) {
+        double energy = 0;
+        for (size_t f = i * hop; f < (i + 1) * hop; ++f) {
+            double sample = 0;
+            for (int c = 0; c < channels; ++c) sample += musicSamples[f * channels + c];
+            double diff = sample - prevSample;
+            prevSample = sample;
+            energy += diff * diff;
+        }
+        double logEnergy = log(1 + energy / hop);
+        onset[i] = std::max(0.0, logEnergy - prevLogEnergy);
+        prevLogEnergy = logEnergy;
+    }
+
+    int lagMin = static_cast<int>(floor(rate * 60 / DETECT_BPM_MAX));
+    int lagMax = static_cast<int>(ceil(rate * 60 / DETECT_BPM_MIN));
+    std::vector<double> corr(lagMax + 2, 0.0);
+    for (int lag = lagMin - 1; lag <= lagMax + 1; ++lag) {
+        double sum = 0;
+        for (size_t i = 0; i + lag < nhops; ++i) sum += onset[i] * onset[i + lag];
+        corr[lag] = sum;
+    }
+
+    int bestLag = lagMin;
+    double bestScore = -1;
+    for (int lag = lagMin; lag <= lagMax; ++lag) {
+        double octaves = log2(60 * rate / lag / 120.0);
+        double score = corr[lag] * exp(-0.5 * octaves * octaves);
+        if (score > bestScore) {
+            bestScore = score;
+            bestLag = lag;
+        }
+    }
+
+    // Parabolic interpolation for a fractional period.
+    double period = bestLag;
+    double a = corr[bestLag - 1], b = corr[bestLag], c = corr[bestLag + 1];
+    if (a - 2 * b + c < 0) period += 0.5 * (a - c) / (a - 2 * b + c);
+
+    // A small error in the period adds up over a whole song, so refine it
+    // together with the phase.
+    double bestPeriod = period;
+    double bestPhase = 0;
+    bestScore = -1;
+    for (double p = period - 1; p <= period + 1; p += 0.01) {
+        for (int phase = 0; phase < static_cast<int>(ceil(p)); ++phase) {
+            double sum = 0;
+            for (double t = phase; t < nhops; t += p) sum += onset[static_cast<size_t>(t)];
+            if (sum > bestScore) {
+                bestScore = sum;
+                bestPeriod = p;
+                bestPhase = phase;
+            }
+        }
+    }
+    period = bestPeriod;
+
+    detectedBpm = 60 * rate / period;
+    detectedOffset_ms = 1000.0 * bestPhase / rate;
+    printf("Detected %.2f bpm, first beat at %.1f ms\n", detectedBpm, detectedOffset_ms);
+    beatDetectDone.store(true, std::memory_order_release);
+}
+
+void StartBeatDetection()
+{
+#ifdef DH_THREADS
+    beatDetectThread = std::thread(DetectBeats);
+#else
+    DetectBeats();
+#endif
+}
+
+void StopBeatDetection()
+{
+#ifdef DH_THREADS
+    if (beatDetectThread.joinable()) beatDetectThread.join();
+#endif
+}
+
+// Difficulty analysis, by dynamic programming over sets of lanes held as
+// bitmasks. It follows PlayMove() and CheckCollision(): each input moves
+// one lane either way, stays, or hurdles in place, and the lane entered must
+// not hold a wall, must hold a hurdle when hurdling and must not otherwise.
+struct Difficulty
+{
+    int beats;
+    bool survivable;
+    int furthest;       // beats survived by the best path
+    int safeStarts;     // starting lanes from which the end can be reached
+    double log2Paths;   // surviving sequences of inputs, log2
+    int minActions;     // fewest moves and hurdles on any surviving path
+    int forcedHurdles;  // beats at which every surviving path hurdles
+    double tightness;   // mean fraction of the three choices (left, right,
+                        // stay or hurdle) that are fatal from a surviving lane
+};
+
+// Bit k of the result is bit k - 1 of m, wrapping around n lanes.
+uint16_t ShiftLanesUp(uint16_t m, int n)
+{
+    return (m << 1 | m >> (n - 1)) & ((1 << n) - 1);
+}
+
+uint16_t ShiftLanesDown(uint16_t m, int n)
+{
+    return (m >> 1 | m << (n - 1)) & ((1 << n) - 1);
+}
+
+int CountLanes(uint16_t m)
+{
+    m = m - (m >> 1 & 0x5555);
+    m = (m & 0x3333) + (m >> 2 & 0x3333);
+    m = (m + (m >> 4)) & 0x0F0F;
+    return (m + (m >> 8)) & 0x1F;
+}
+
+uint16_t SpreadLanes(uint16_t m, int n)
+{
+    return m | ShiftLanesUp(m, n) | ShiftLanesDown(m, n);
+}
+
+// Lanes the player can be alive in after one beat, from the lanes in from.
+uint16_t StepLanes(uint16_t from, uint16_t walls, uint16_t hurdles, int n)
+{
+    hurdles &= ~walls;
+    return (SpreadLanes(from, n) & ~walls & ~hurdles) | (from & hurdles);
+}
+
+// Lanes from which one beat can reach a lane in to.
+uint16_t UnstepLanes(uint16_t to, uint16_t walls, uint16_t hurdles, int n)
+{
+    hurdles &= ~walls;
+    return SpreadLanes(to & ~walls & ~hurdles, n) | (to & hurdles);
+}
+
+// The number of safe choices, over all lanes in from, for one beat into the
+// lanes in to with the given hurdles. From each lane, moving left or right is
+// safe into a lane in to without a hurdle, and staying or hurdling into its
+// own lane if that is in to.
+int SafeChoices(uint16_t from, uint16_t to, uint16_t hurdles, int n)
+{
+    uint16_t moveTo = to & ~hurdles;
+    return CountLanes(from & ShiftLanesDown(moveTo, n))
+        + CountLanes(from & ShiftLanesUp(moveTo, n))
+        + CountLanes(from & to);
+}
+
+// Analyzes nbeats beats of walls and hurdles, the first being the one the
+// first input lands on, for a player starting in one of the start lanes.
+Difficulty AnalyzeRows(int n, uint16_t start, const uint16_t *walls, const uint16_t *hurdles, int nbeats)
+{
+    Difficulty d = Difficulty();
+    d.beats = nbeats;
+
+    // Forward: the lanes reachable alive after each beat.
+    std::vector<uint16_t> alive(nbeats);
+    uint16_t lanes = start;
+    for (int b = 0; b < nbeats && lanes; ++b) {
+        lanes = StepLanes(lanes, walls[b], hurdles[b], n);
+        alive[b] = lanes;
+        if (lanes) d.furthest = b + 1;
+    }
+    d.survivable = lanes != 0;
+    if (!d.survivable) return d;
+
+    // Backward: keep only the lanes that still lead to the end.
+    for (int b = nbeats - 2; b >= 0; --b) {
+        alive[b] &= UnstepLanes(alive[b + 1], walls[b + 1], hurdles[b + 1], n);
+    }
+    uint16_t starts = nbeats ? start & UnstepLanes(alive[0], walls[0], hurdles[0], n) : start;
+    d.safeStarts = CountLanes(starts);
+
+    // Count paths and the fewest actions lane by lane, through surviving
+    // lanes only. Counts are rescaled now and then to stay in range. Lane k
+    // is kept at index k + 1, with copies of the last lane at 0 and of the
+    // first at n + 1, so that every lane finds its neighbours the same way
+    // and the loop has no branches.
+    const int NO_PATH = 1 << 29;
+    const int BIG_LOG2 = 512;
+    const double BIG = std::ldexp(1.0, BIG_LOG2);
+    double count[LANES_MAX + 2];
+    int cost[LANES_MAX + 2];
+    for (int k = 0; k < n; ++k) {
+        count[k + 1] = starts >> k & 1;
+        cost[k + 1] = starts >> k & 1 ? 0 : NO_PATH;
+    }
+
+    double thirdOf[LANES_MAX + 1] = { 0 };
+    for (int c = 1; c <= LANES_MAX; ++c) thirdOf[c] = 1 / (3.0 * c);
+
+    double log2Scale = 0;
+    double fatal = 0;
+    uint16_t prev = starts;
+    for (int b = 0; b < nbeats; ++b) {
+        uint16_t a = alive[b];
+        uint16_t h = hurdles[b] & ~walls[b];
+        count[0] = count[n];
+        count[n + 1] = count[1];
+        cost[0] = cost[n];
+        cost[n + 1] = cost[1];
+
+        double nextCount[LANES_MAX];
+        int nextCost[LANES_MAX];
+        double total = 0;
+        for (int k = 0; k < n; ++k) {
+            bool isAlive = a >> k & 1;
+            bool isHurdle = h >> k & 1;
+            double moved = count[k] + count[k + 1] + count[k + 2];
+            int movedCost = std::min(cost[k + 1], std::min(cost[k], cost[k + 2]) + 1);
+            nextCount[k] = isAlive ? (isHurdle ? count[k + 1] : moved) : 0;
+            nextCost[k] = isAlive ? (isHurdle ? cost[k + 1] + 1 : movedCost) : NO_PATH;
+            total += nextCount[k];
+        }
+        double rescale = total > BIG ? 1 / BIG : 1;
+        if (rescale != 1) log2Scale += BIG_LOG2;
+        for (int k = 0; k < n; ++k) {
+            count[k + 1] = nextCount[k] * rescale;
+            cost[k + 1] = nextCost[k];
+        }
+
+        if ((a & h) == a) ++d.forcedHurdles;
+
+        fatal += 1 - SafeChoices(prev, a, h, n) * thirdOf[CountLanes(prev)];
+        prev = a;
+    }
+
+    double total = 0;
+    d.minActions = NO_PATH;
+    for (int k = 1; k <= n; ++k) {
+        total += count[k];
+        d.minActions = std::min(d.minActions, cost[k]);
+    }
+    d.log2Paths = std::log2(total) + log2Scale;
+    d.tightness = nbeats ? fatal / nbeats : 0;
+    return d;
+}
+
+// The player starts in lane 0, and the first input lands on beat 1.
+Difficulty AnalyzeLevel(const Level &level)
+{
+    return AnalyzeRows(level.nlanes, 1, level.walls + 1, level.hurdles + 1, LEVEL_LEN - 1);
+}
+
+// A pattern on its own, entered from any lane.
+Difficulty AnalyzePattern(const PatternLibrary &lib, uint32_t p)
+{
+    const PatternSpan &s = lib.spans[p];
+    std::vector<uint16_t> walls(s.count), hurdles(s.count);
+    for (uint32_t j = 0; j < s.count; ++j) {
+        walls[j] = lib.rows[s.first + j].walls;
+        hurdles[j] = lib.rows[s.first + j].hurdles;
+    }
+    return AnalyzeRows(lib.nlanes, (1 << lib.nlanes) - 1, walls.data(), hurdles.data(), s.count);
+}
+
+std::shared_ptr<Level> GenerateLevel(const PatternLibrary *lib)
+{
+    std::shared_ptr<Level> level = std::make_shared<Level>();
+    int n = lib->nlanes;
+    level->nlanes = n;
+
+    for (int i = 0; i < LEVEL_LEN; ++i) {
+        level->walls[i] = 0;
+        level->hurdles[i] = 0;
+    }
+
+    int i = INTRO_LEN;
+    uint32_t type = 0;
+    bool first = true;
+    while (true) {
+        // Select random pattern, following the previous one's transitions
+        // if it has any, then a random flip and rotation.
+        const PatternSpan &next = lib->transitionSpans[type];
+        if (first || next.count == 0) type = SampleAlias(lib->select, lib->npatterns);
+        else type = SampleAlias(lib->transitionColumns + next.first, next.count);
+        first = false;
+        int transform = std::uniform_int_distribution<int>(0, lib->ntransforms - 1)(rng);
+
+        const PatternSpan &p = lib->variants[lib->variantOf[type * lib->ntransforms + transform]];
+
+        if (p.count >= static_cast<uint32_t>(LEVEL_LEN - i)) break;
+
+        for (uint32_t j = 0; j < p.count; ++j) {
+            const PatternRow &row = lib->variantRows[p.first + j];
+            level->walls[i] = row.walls;
+            level->hurdles[i] = row.hurdles;
+            ++i;
+        }
+    }
+
+    return level;
+}
+
+// Difficulty-targeted generation (--target-difficulty FROM TO): a beam
+// search over pattern sequences for a level whose tightness runs in a
+// straight line from FROM at the start to TO at the end. Each candidate is
+// scored only over the pattern it appends, continuing from the lanes its
+// parent could reach, so tightness here looks forward from the reachable
+// lanes rather than back from the end as in AnalyzeRows().
+bool targetDifficulty = false;
+double targetFrom, targetTo;
+const int BEAM_WIDTH = 32;
+const int BEAM_CANDIDATES = 24;
+const uint32_t NO_VARIANT = 0xFFFFFFFF;
+
+struct BeamNode
+{
+    int parent;         // index into the search's nodes, -1 for the root
+    uint32_t type;      // the last pattern placed
+    uint32_t variant;   // rows appended by this node, or NO_VARIANT
+    int end;            // beats filled so far
+    uint16_t reach;     // lanes the player can be alive in at beat end - 1
+    bool done;          // the level is complete
+    double error;       // summed squared distance from the target
+};
+
+double TargetTightness(int beat)
+{
+    return targetFrom + (targetTo - targetFrom) * beat / (LEVEL_LEN - 1);
+}
+
+// One beat of forward tightness: the fraction of the choices from the lanes
+// in reach that are fatal. Moves reach on to the lanes alive after the beat.
+double StepFatal(uint16_t &reach, uint16_t walls, uint16_t hurdles, int n)
+{
+    uint16_t to = StepLanes(reach, walls, hurdles, n);
+    double fatal = 1 - SafeChoices(reach, to, hurdles & ~walls, n) / (3.0 * CountLanes(reach));
+    reach = to;
+    return fatal;
+}
+
+// Root mean square distance of a level's forward tightness from the target,
+// over the beats after the intro that the player can reach.
+double TargetMiss(const Level &level)
+{
+    uint16_t reach = 1;
+    double error = 0;
+    int beats = 0;
+    for (int b = 1; b < LEVEL_LEN && reach; ++b) {
+        double fatal = StepFatal(reach, level.walls[b], level.hurdles[b], level.nlanes);
+        if (b < INTRO_LEN) continue;
+        double miss = fatal - TargetTightness(b);
+        error += miss * miss;
+        ++beats;
+    }
+    return beats ? std::sqrt(error / beats) : 0;
+}
+
+double BeamScore(const BeamNode &node)
+{
+    return node.error / (node.end - INTRO_LEN);
+}
+
+std::shared_ptr<Level> GenerateTargetedLevel(const PatternLibrary *lib)
+{
+    int n = lib->nlanes;
+
+    // The intro is empty: start in lane 0 and spread from there.
+    BeamNode root = { -1, 0, NO_VARIANT, INTRO_LEN, 1, false, 0 };
+    for (int b = 1; b < INTRO_LEN; ++b) root.reach = SpreadLanes(root.reach, n);
+
+    std::vector<BeamNode> nodes(1, root);
+    std::vector<int> beam(1, 0), next;
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        next.clear();
+        for (int idx : beam) {
+            if (nodes[idx].done) {
+                next.push_back(idx);
+                continue;
+            }
+
+            bool expanded = false;
+            for (int c = 0; c < BEAM_CANDIDATES; ++c) {
+                const BeamNode &parent = nodes[idx];
+                const PatternSpan &follow = lib->transitionSpans[parent.type];
+                uint32_t type = parent.variant == NO_VARIANT || follow.count == 0
+                    ? SampleAlias(lib->select, lib->npatterns)
+                    : SampleAlias(lib->transitionColumns + follow.first, follow.count);
+                int transform = std::uniform_int_distribution<int>(0, lib->ntransforms - 1)(rng);
+                uint32_t variant = lib->variantOf[type * lib->ntransforms + transform];
+                const PatternSpan &p = lib->variants[variant];
+                if (p.count >= static_cast<uint32_t>(LEVEL_LEN - parent.end)) continue;
+
+                BeamNode child = { idx, type, variant, parent.end + static_cast<int>(p.count), parent.reach, false, parent.error };
+                for (uint32_t j = 0; j < p.count && child.reach; ++j) {
+                    const PatternRow &row = lib->variantRows[p.first + j];
+                    double miss = StepFatal(child.reach, row.walls, row.hurdles, n) - TargetTightness(parent.end + j);
+                    child.error += miss * miss;
+                }
+                if (!child.reach) continue;
+
+                next.push_back(nodes.size());
+                nodes.push_back(child);
+                expanded = true;
+            }
+
+            // Nothing more fits (or survives): the rest of the level stays
+            // empty, where no choice is fatal.
+            if (!expanded) {
+                BeamNode last = nodes[idx];
+                last.parent = idx;
+                last.variant = NO_VARIANT;
+                for (int b = last.end; b < LEVEL_LEN; ++b) last.error += TargetTightness(b) * TargetTightness(b);
+                last.end = LEVEL_LEN;
+                last.done = true;
+                next.push_back(nodes.size());
+                nodes.push_back(last);
+            }
+            grew = grew || expanded;
+        }
+
+        size_t keep = std::min<size_t>(BEAM_WIDTH, next.size());
+        std::partial_sort(next.begin(), next.begin() + keep, next.end(),
+            [&](int x, int y) { return BeamScore(nodes[x]) < BeamScore(nodes[y]); });
+        next.resize(keep);
+        beam.swap(next);
+    }
+
+    std::vector<uint32_t> chosen;
+    for (int idx = beam[0]; idx >= 0; idx = nodes[idx].parent) {
+        if (nodes[idx].variant != NO_VARIANT) chosen.push_back(nodes[idx].variant);
+    }
+
+    std::shared_ptr<Level> level = std::make_shared<Level>();
+    level->nlanes = n;
+    for (int i = 0; i < LEVEL_LEN; ++i) {
+        level->walls[i] = 0;
+        level->hurdles[i] = 0;
+    }
+    int i = INTRO_LEN;
+    for (size_t k = chosen.size(); k-- > 0; ) {
+        const PatternSpan &p = lib->variants[chosen[k]];
+        for (uint32_t j = 0; j < p.count; ++j) {
+            const PatternRow &row = lib->variantRows[p.first + j];
+            level->walls[i] = row.walls;
+            level->hurdles[i] = row.hurdles;
+            ++i;
+        }
+    }
+    return level;
+}
+
+void Restart(GameState &g)
+{
+    std::shared_ptr<const PatternLibrary> lib = Patterns(g.section);
+    g.level = targetDifficulty ? GenerateTargetedLevel(lib.get()) : GenerateLevel(lib.get());
+    g.offset = 0;
+    g.playerLane = 0;
+    g.playerAlive = true;
+    g.playerHurdling = false;
+
+    // Anything long ago is fine.
+    g.advanceTime = 0;
+
+    g.beatOrigin = 0;
+    g.lastBeat = -1;
+    if (musicSamples) RestartMusic();
+    g.judgement = JUDGE_NONE;
+    g.judgeError_ms = 0;
+    for (int j = 0; j < 4; ++j) g.judgeCounts[j] = 0;
+}
+
+int GetIncomingBandType(const GameState &g, int lane, int bandNum)
+{
+    bandNum += g.offset;
+    if (bandNum < 0 || LEVEL_LEN <= bandNum) return BAND_TYPE_NONE;
+    if (g.level->walls[bandNum] >> lane & 1) return BAND_TYPE_WALL;
+    if (g.level->hurdles[bandNum] >> lane & 1) return BAND_TYPE_HURDLE;
+    return BAND_TYPE_NONE;
+}
+
+void CheckCollision(GameState &g)
+{
+    int t = GetIncomingBandType(g, g.playerLane, 0);
+    if (t == BAND_TYPE_WALL ||
+            (t == BAND_TYPE_HURDLE && !g.playerHurdling) ||
+            (t == BAND_TYPE_NONE && g.playerHurdling)) {
+        g.playerAlive = false;
+    }
+}
+
+void Advance(GameState &g, Uint64 when)
+{
+    g.advanceTime = when;
+    ++g.offset;
+    CheckCollision(g);
+    g.playerHurdling = false;
+}
+
+// --analyze: print the difficulty of each pattern and of a sample of
+// generated levels, then exit.
+bool analyzePatterns = false;
+const int ANALYZE_LEVELS = 1000;
+const int ANALYZE_TARGETED_LEVELS = 50;
+
+void AnalyzePatterns()
+{
+    std::shared_ptr<const PatternLibrary> lib = CurrentPatterns();
+    std::printf("%s: %d lanes, %u patterns (%u distinct with rotations and flips)\n",
+        patternsPath, lib->nlanes, lib->npatterns, lib->nvariants);
+
+    std::printf("pattern  rows  safe starts  log2 paths  min actions  forced hurdles  tightness\n");
+    for (uint32_t p = 0; p < lib->npatterns; ++p) {
+        Difficulty d = AnalyzePattern(*lib, p);
+        if (!d.survivable) {
+            std::printf("%7u  %4d  impossible (dies by row %d)\n", p, d.beats, d.furthest + 1);
+            continue;
+        }
+        std::printf("%7u  %4d  %11d  %10.2f  %11d  %14d  %9.3f\n",
+            p, d.beats, d.safeStarts, d.log2Paths, d.minActions, d.forcedHurdles, d.tightness);
+    }
+
+    // Targeted levels take much longer to make, so fewer are sampled.
+    int nlevels = targetDifficulty ? ANALYZE_TARGETED_LEVELS : ANALYZE_LEVELS;
+    int survivable = 0;
+    double sumPaths = 0, sumActions = 0, sumForced = 0, sumTightness = 0, sumMiss = 0;
+    double minPaths = HUGE_VAL, maxTightness = 0;
+    Uint64 generateTicks = 0, analyzeTicks = 0;
+    for (int i = 0; i < nlevels; ++i) {
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        std::shared_ptr<Level> level = targetDifficulty ? GenerateTargetedLevel(lib.get()) : GenerateLevel(lib.get());
+        Uint64 t1 = SDL_GetPerformanceCounter();
+        Difficulty d = AnalyzeLevel(*level);
+        analyzeTicks += SDL_GetPerformanceCounter() - t1;
+        generateTicks += t1 - t0;
+        if (targetDifficulty) sumMiss += TargetMiss(*level);
+        if (!d.survivable) continue;
+
+        ++survivable;
+        sumPaths += d.log2Paths;
+        sumActions += static_cast<double>(d.minActions) / d.beats;
+        sumForced += static_cast<double>(d.forcedHurdles) / d.beats;
+        sumTightness += d.tightness;
+        minPaths = std::min(minPaths, d.log2Paths);
+        maxTightness = std::max(maxTightness, d.tightness);
+    }
+
+    std::printf("%d generated levels: %.1f%% survivable", nlevels, 100.0 * survivable / nlevels);
+    if (survivable) {
+        std::printf(", mean of those: log2 paths %.1f (min %.1f), min actions per beat %.3f,\n"
+            "forced hurdles per beat %.3f, tightness %.3f (max %.3f)",
+            sumPaths / survivable, minPaths, sumActions / survivable,
+            sumForced / survivable, sumTightness / survivable, maxTightness);
+    }
+    std::printf("\n");
+    if (targetDifficulty) {
+        std::printf("target tightness %.3f to %.3f, missed by %.3f (rms) on average\n", targetFrom, targetTo, sumMiss / nlevels);
+    }
+    double ticksPerUs = SDL_GetPerformanceFrequency() / 1e6;
+    std::printf("generation took %.2f us and analysis %.2f us per level\n",
+        generateTicks / ticksPerUs / nlevels, analyzeTicks / ticksPerUs / nlevels);
+}
+
+// --analyze-batch FILE...: --analyze each file in turn, reporting and
+// skipping the ones that don't load. Returns whether they all did.
+std::vector<const char *> analyzeBatchPaths;
+
+bool AnalyzeBatch()
+{
+    int skipped = 0;
+    for (const char *path : analyzeBatchPaths) {
+        LoadError err;
+        std::shared_ptr<const PatternLibrary> lib = ReadPatterns(path, err);
+        if (!lib) {
+            std::printf("skipped %s\n\n", DescribeLoadError(err).c_str());
+            ++skipped;
+            continue;
+        }
+        std::atomic_store(&patternLibs[0], lib);
+        patternsPath = path;
+        AnalyzePatterns();
+        std::printf("\n");
+    }
+    std::printf("analyzed %d of %d files\n", static_cast<int>(analyzeBatchPaths.size()) - skipped,
+        static_cast<int>(analyzeBatchPaths.size()));
+    return skipped == 0;
+}
+
+void ReadBeatClock(const char *path)
+{
+    FILE * f = fopen(path, "r");
+    if (!f) failAny("fopen beat clock");
+
+    if (fscanf(f, " %lf %lf", &beatBpm, &beatOffset_ms) != 2) failAny("could not read bpm and offset");
+    if (!(beatBpm > 0)) failAny("bpm must be positive");
+    printf("Beat clock: %.2f bpm, first beat at %.1f ms\n", beatBpm, beatOffset_ms);
+
+    if (fclose(f)) failAny("fclose");
+    beatClock = true;
+}
+
+Uint64 BeatTime(Uint64 origin, long long beat)
+{
+    double freq = static_cast<double>(SDL_GetPerformanceFrequency());
+    double ticks = (judgeOffset_ms / 1000.0 + beat * 60.0 / judgeBpm) * freq;
+    return origin + static_cast<Sint64>(llround(ticks));
+}
+
+// Whether inputs can be judged yet, taking the simulation's copy of the grid
+// the first time. With music and no beat clock file, the grid comes from
+// DetectBeats() once it finishes.
+bool BeatClockReady()
+{
+    if (!beatClock) return false;
+    if (judgeBpm > 0) return true;
+    if (beatBpm > 0) {
+        judgeBpm = beatBpm;
+        judgeOffset_ms = beatOffset_ms;
+        return true;
+    }
+    if (!beatDetectDone.load(std::memory_order_acquire)) return false;
+
+    judgeBpm = detectedBpm;
+    judgeOffset_ms = detectedOffset_ms;
+    return true;
+}
+
+// Judge an input against the nearest beat not already used, and return that
+// beat's time.
+Uint64 JudgeInput(GameState &g, Uint64 time)
+{
+    if (musicSamples) {
+        // The music's timeline, once the audio callback has stamped it.
+        g.beatOrigin = musicOrigin.load();
+        if (!g.beatOrigin) return time;
+    } else if (!g.beatOrigin) {
+        // Otherwise the first input of a level starts the clock, on a beat.
+        g.beatOrigin = time - BeatTime(0, 0);
+    }
+
+    double freq = static_cast<double>(SDL_GetPerformanceFrequency());
+    double sinceFirst = static_cast<double>(static_cast<Sint64>(time - BeatTime(g.beatOrigin, 0))) / freq;
+    long long beat = llround(sinceFirst * judgeBpm / 60.0);
+    if (beat <= g.lastBeat) beat = g.lastBeat + 1;
+    g.lastBeat = beat;
+
+    Uint64 beatTime = BeatTime(g.beatOrigin, beat);
+    g.judgeError_ms = 1000.0 * static_cast<Sint64>(time - beatTime) / freq;
+
+    double err = fabs(g.judgeError_ms);
+    g.judgement = err <= JUDGE_PERFECT_MS ? JUDGE_PERFECT : err <= JUDGE_GOOD_MS ? JUDGE_GOOD : JUDGE_MISS;
+    ++g.judgeCounts[g.judgement];
+    return beatTime;
+}
+
+// Hyper mode: having reached the end of a level alive, carry straight on
+// into a level from the next pattern file, in the lane nearest the same
+// angle. Both levels are empty around the join.
+void NextSection(GameState &g)
+{
+    int from = g.level->nlanes;
+    g.section = (g.section + 1) % PatternFileCount();
+    std::shared_ptr<const PatternLibrary> lib = Patterns(g.section);
+    g.level = targetDifficulty ? GenerateTargetedLevel(lib.get()) : GenerateLevel(lib.get());
+    g.offset = 0;
+    int to = g.level->nlanes;
+    g.playerLane = (2 * g.playerLane * to + from) / (2 * from) % to;
+}
+
+// The rules of a move on its own, with no beat clock and no globals: the
+// headless tools play through this. Does nothing once the player is dead.
+void PlayMove(GameState &g, int type, Uint64 when)
+{
+    if (!g.playerAlive) return;
+
+    int n = g.level->nlanes;
+    if (type == INPUT_LEFT) {
+        g.playerLane = (g.playerLane + 1) % n;
+    } else if (type == INPUT_RIGHT) {
+        g.playerLane = (g.playerLane + n - 1) % n;
+    } else if (type == INPUT_HURDLE) {
+        g.playerHurdling = true;
+    }
+    Advance(g, when);
+}
+
+// Returns whether the input changed the state.
+bool ApplyInput(GameState &g, const InputEvent &e)
+{
+    if (e.type == INPUT_RESTART) {
+        Restart(g);
+        return true;
+    }
+    if (e.type == INPUT_NEXT_PATTERNS) {
+        g.section = (g.section + 1) % PatternFileCount();
+        Restart(g);
+        return true;
+    }
+
+    if (!g.playerAlive) return false;
+
+    // With a beat clock, animation runs from the beat the input was judged
+    // against rather than from the keypress, so it stays on the music.
+    Uint64 animTime = e.time;
+    if (BeatClockReady()) {
+        animTime = JudgeInput(g, e.time);
+        if (beatStrict && g.judgement == JUDGE_MISS) {
+            g.playerAlive = false;
+            return true;
+        }
+    }
+
+    if (g.offset >= LEVEL_LEN - 1 && PatternFileCount() > 1) NextSection(g);
+
+    PlayMove(g, e.type, animTime);
+    return true;
+}
+
+// Apply everything queued so far and publish the result.
+void SimulatePending()
+{
+    bool changed = false;
+    InputEvent e;
+    while (inputQueue.Pop(&e)) {
+        if (!ApplyInput(sim, e)) continue;
+
+        int slot = ++sim.inputSeq % INPUT_HISTORY;
+        sim.inputPollTime[slot] = e.time;
+        sim.inputApplyTime[slot] = SDL_GetPerformanceCounter();
+        changed = true;
+    }
+
+    if (changed) {
+        published.Back() = sim;
+        published.Publish();
+    }
+}
+
+#ifdef DH_THREADS
+void SimulationThread()
+{
+    while (!simQuit.load()) {
+        SDL_SemWait(simWake);
+        SimulatePending();
+    }
+}
+#endif
+
+// Called on the main thread for each input, in order.
+void SubmitInput(int type, Uint64 time)
+{
+    InputEvent e = { type, time };
+    if (!inputQueue.Push(e)) {
+        std::printf("input queue full, dropping input\n");
+        return;
+    }
+
+#ifdef DH_THREADS
+    SDL_SemPost(simWake);
+#else
+    SimulatePending();
+#endif
+}
+
+// Generate the first level and hand sim over to the simulation thread.
+void StartSimulation()
+{
+    Restart(sim);
+    published.Back() = sim;
+    published.Publish();
+
+#ifdef DH_THREADS
+    simWake = SDL_CreateSemaphore(0);
+    if (!simWake) failSDL("SDL_CreateSemaphore");
+    simThread = std::thread(SimulationThread);
+#endif
+}
+
+void StopSimulation()
+{
+#ifdef DH_THREADS
+    if (simThread.joinable()) {
+        simQuit.store(true);
+        SDL_SemPost(simWake);
+        simThread.join();
+    }
+    if (simWake) {
+        SDL_DestroySemaphore(simWake);
+        simWake = NULL;
+    }
+#endif
+}
+
+// The bot plays a precomputed surviving path. Planning works back from the
+// end of the level to find the lanes from which the rest can be survived,
+// then forward from the player choosing, at each beat, an input that keeps
+// to those lanes, staying put when it can.
+bool PlanPath(const Level &level, int offset, int lane, std::vector<int> &inputs)
+{
+    int n = level.nlanes;
+    inputs.clear();
+    if (offset >= LEVEL_LEN - 1) return true;
+
+    uint16_t good[LEVEL_LEN];
+    good[LEVEL_LEN - 1] = (1 << n) - 1;
+    for (int b = LEVEL_LEN - 2; b >= offset; --b) {
+        good[b] = UnstepLanes(good[b + 1], level.walls[b + 1], level.hurdles[b + 1], n);
+    }
+    if (!(good[offset] >> lane & 1)) return false;
+
+    for (int b = offset + 1; b < LEVEL_LEN; ++b) {
+        uint16_t safe = good[b] & ~level.walls[b];
+        uint16_t hurdle = safe & level.hurdles[b];
+        uint16_t plain = safe & ~level.hurdles[b];
+        int up = (lane + 1) % n;
+        int down = (lane + n - 1) % n;
+        if (hurdle >> lane & 1) {
+            inputs.push_back(INPUT_HURDLE);
+        } else if (plain >> lane & 1) {
+            inputs.push_back(INPUT_STAY);
+        } else if (plain >> up & 1) {
+            inputs.push_back(INPUT_LEFT);
+            lane = up;
+        } else {
+            assert(plain >> down & 1);
+            inputs.push_back(INPUT_RIGHT);
+            lane = down;
+        }
+    }
+    return true;
+}
+
+// --bot-benchmark: let the bot play generated levels headlessly through
+// PlayMove(), as a benchmark of the simulation and a check of the pattern
+// file. Returns whether every level could be survived and the bot did.
+bool botBenchmark = false;
+const int BOT_BENCH_LEVELS = 1000;
+const int BOT_BENCH_TARGETED_LEVELS = 50;
+const int BOT_BENCH_REPLAYS = 20;
+
+bool BotBenchmark()
+{
+    int nlevels = targetDifficulty ? BOT_BENCH_TARGETED_LEVELS : BOT_BENCH_LEVELS;
+    int impossible = 0, failed = 0;
+    long long beats = 0;
+    Uint64 planTicks = 0, playTicks = 0;
+    std::vector<int> inputs;
+    GameState g = GameState();
+    for (int i = 0; i < nlevels; ++i) {
+        Restart(g);
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        bool possible = PlanPath(*g.level, g.offset, g.playerLane, inputs);
+        planTicks += SDL_GetPerformanceCounter() - t0;
+        if (!possible) {
+            ++impossible;
+            continue;
+        }
+
+        GameState start = g;
+        for (int r = 0; r < BOT_BENCH_REPLAYS; ++r) {
+            g = start;
+            Uint64 t1 = SDL_GetPerformanceCounter();
+            for (int input : inputs) PlayMove(g, input, 0);
+            playTicks += SDL_GetPerformanceCounter() - t1;
+            beats += inputs.size();
+        }
+        if (!g.playerAlive) ++failed;
+    }
+
+    double freq = SDL_GetPerformanceFrequency();
+    std::printf("%s: bot survived %d of %d levels (%d impossible)\n",
+        patternsPath, nlevels - impossible - failed, nlevels, impossible);
+    std::printf("planning took %.2f us per level", 1e6 * planTicks / freq / nlevels);
+    if (playTicks) std::printf("; simulation ran %.1f million beats per second", beats / (playTicks / freq) / 1e6);
+    std::printf("\n");
+    if (impossible) std::printf("failed: %d levels can't be survived\n", impossible);
+    if (failed) std::printf("failed: the bot died on %d levels it planned to survive\n", failed);
+    return impossible == 0 && failed == 0;
+}
+
+// --monte-carlo N: estimate how far people get by having a noisy player
+// model play N games on each of a sample of generated levels. The model sees
+// only as far ahead as the screen shows. Each beat it picks, among the inputs
+// that keep it alive over that window, its own lane with probability
+// playerStayBias and otherwise any of them at random; then with probability
+// playerError it presses a random key instead, or with probability
+// playerMiss reacts too late and repeats its last input.
+int monteCarloGames = 0;
+double playerError = 0.02;
+double playerMiss = 0.02;
+double playerStayBias = 0.5;
+const int MONTE_CARLO_LEVELS = 20;
+const int PLAYER_LOOKAHEAD = NBANDS;
+
+// Lanes at each beat from which the following window beats can be survived.
+void LookaheadLanes(const Level &level, int window, uint16_t *good)
+{
+    int n = level.nlanes;
+    for (int b = 0; b < LEVEL_LEN; ++b) {
+        uint16_t lanes = (1 << n) - 1;
+        for (int c = std::min(b + window, LEVEL_LEN - 1); c > b; --c) {
+            lanes = UnstepLanes(lanes, level.walls[c], level.hurdles[c], n);
+        }
+        good[b] = lanes;
+    }
+}
+
+struct MonteCarloJob
+{
+    const Level *level;
+    const uint16_t *good;
+    int games;
+    unsigned seed;
+    std::vector<int> deaths;    // games that died on each beat
+};
+
+// Everything a worker touches is its own or read-only, so workers scale
+// with cores.
+void RunMonteCarlo(MonteCarloJob *job)
+{
+    std::minstd_rand r(job->seed);
+    std::uniform_real_distribution<double> coin(0, 1);
+    const Level &level = *job->level;
+    int n = level.nlanes;
+
+    // A non-owning pointer: the level outlives the workers, and this way no
+    // reference count is shared between them.
+    GameState g = GameState();
+    g.level = std::shared_ptr<const Level>(std::shared_ptr<const Level>(), job->level);
+    for (int i = 0; i < job->games; ++i) {
+        g.offset = 0;
+        g.playerLane = 0;
+        g.playerAlive = true;
+        g.playerHurdling = false;
+
+        int last = INPUT_STAY;
+        while (g.playerAlive && g.offset < LEVEL_LEN - 1) {
+            int b = g.offset + 1;
+            uint16_t ok = job->good[b] & ~level.walls[b];
+            uint16_t hurdle = ok & level.hurdles[b];
+            uint16_t plain = ok & ~level.hurdles[b];
+            int lane = g.playerLane;
+            int up = (lane + 1) % n;
+            int down = (lane + n - 1) % n;
+
+            int options[3];
+            int noptions = 0;
+            int own = -1;
+            if (hurdle >> lane & 1) own = INPUT_HURDLE;
+            else if (plain >> lane & 1) own = INPUT_STAY;
+            if (own >= 0) options[noptions++] = own;
+            if (plain >> up & 1) options[noptions++] = INPUT_LEFT;
+            if (plain >> down & 1) options[noptions++] = INPUT_RIGHT;
+
+            int input = INPUT_STAY;
+            if (own >= 0 && coin(r) < playerStayBias) input = own;
+            else if (noptions) input = options[std::uniform_int_distribution<int>(0, noptions - 1)(r)];
+
+            double u = coin(r);
+            if (u < playerError) input = std::uniform_int_distribution<int>(INPUT_LEFT, INPUT_HURDLE)(r);
+            else if (u < playerError + playerMiss) input = last;
+
+            PlayMove(g, input, 0);
+            last = input;
+        }
+        if (!g.playerAlive) ++job->deaths[g.offset];
+    }
+}
+
+void MonteCarlo()
+{
+    std::shared_ptr<const PatternLibrary> lib = CurrentPatterns();
+
+    int nthreads = 1;
+#ifdef DH_THREADS
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+#endif
+
+    std::vector<int> deaths(LEVEL_LEN);
+    std::vector<uint16_t> good(LEVEL_LEN);
+    long long games = 0, beats = 0;
+    int impossible = 0;
+    double sumFinished = 0, worstFinished = 1, bestFinished = 0;
+    Uint64 ticks = 0;
+    for (int l = 0; l < MONTE_CARLO_LEVELS; ++l) {
+        std::shared_ptr<Level> level = targetDifficulty ? GenerateTargetedLevel(lib.get()) : GenerateLevel(lib.get());
+        std::vector<int> inputs;
+        if (!PlanPath(*level, 0, 0, inputs)) {
+            ++impossible;
+            continue;
+        }
+        LookaheadLanes(*level, PLAYER_LOOKAHEAD, good.data());
+
+        std::vector<MonteCarloJob> jobs(nthreads);
+        for (int t = 0; t < nthreads; ++t) {
+            jobs[t].level = level.get();
+            jobs[t].good = good.data();
+            jobs[t].games = monteCarloGames / nthreads + (t < monteCarloGames % nthreads);
+            jobs[t].seed = rng();
+            jobs[t].deaths.assign(LEVEL_LEN, 0);
+        }
+
+        Uint64 t0 = SDL_GetPerformanceCounter();
+#ifdef DH_THREADS
+        std::vector<std::thread> workers;
+        for (int t = 1; t < nthreads; ++t) workers.push_back(std::thread(RunMonteCarlo, &jobs[t]));
+        RunMonteCarlo(&jobs[0]);
+        for (std::thread &w : workers) w.join();
+#else
+        RunMonteCarlo(&jobs[0]);
+#endif
+        ticks += SDL_GetPerformanceCounter() - t0;
+
+        int died = 0;
+        for (int t = 0; t < nthreads; ++t) {
+            for (int b = 0; b < LEVEL_LEN; ++b) {
+                deaths[b] += jobs[t].deaths[b];
+                died += jobs[t].deaths[b];
+                beats += static_cast<long long>(b) * jobs[t].deaths[b];
+            }
+        }
+        int finished = monteCarloGames - died;
+        beats += static_cast<long long>(finished) * (LEVEL_LEN - 1);
+        games += monteCarloGames;
+
+        double rate = static_cast<double>(finished) / monteCarloGames;
+        sumFinished += rate;
+        worstFinished = std::min(worstFinished, rate);
+        bestFinished = std::max(bestFinished, rate);
+    }
+
+    std::printf("%s: %d games on each of %d levels (%d impossible, skipped); error %.3f, miss %.3f, stay bias %.2f\n",
+        patternsPath, monteCarloGames, MONTE_CARLO_LEVELS, impossible, playerError, playerMiss, playerStayBias);
+    if (!games) return;
+
+    std::printf("still alive at beat:");
+    long long alive = games;
+    for (int b = 0; b < LEVEL_LEN; ++b) {
+        alive -= deaths[b];
+        if (b % 25 == 0 || b == LEVEL_LEN - 1) std::printf("%s%d: %.1f%%", b % 150 == 0 ? "\n  " : "  ", b, 100.0 * alive / games);
+    }
+    int levels = MONTE_CARLO_LEVELS - impossible;
+    std::printf("\nfinished the level: %.1f%% on average, %.1f%% to %.1f%% by level\n",
+        100 * sumFinished / levels, 100 * worstFinished, 100 * bestFinished);
+    double seconds = static_cast<double>(ticks) / SDL_GetPerformanceFrequency();
+    std::printf("%d threads, %.0f games and %.1f million beats per second\n", nthreads, games / seconds, beats / seconds / 1e6);
+}
+
+// A batch of independent games advanced in lockstep, for tuning levels in
+// bulk. Every game takes one input per step, so all of them are on the same
+// beat and the state is just arrays over games. Levels are stored beat-major
+// so that a step reads each game's cells side by side, and the step itself
+// has no branches. Batches only play: restarts and the beat clock aren't
+// modelled.
+struct GameBatch
+{
+    int ngames;
+    std::vector<uint16_t> walls;    // [beat * ngames + game]
+    std::vector<uint16_t> hurdles;
+    std::vector<uint8_t> nlanes;
+    std::vector<uint8_t> lane;
+    std::vector<uint8_t> alive;
+    std::vector<uint16_t> diedAt;   // beat of death, or LEVEL_LEN
+};
+
+void InitBatch(GameBatch &batch, const std::vector<std::shared_ptr<const Level>> &levels)
+{
+    int ngames = levels.size();
+    batch.ngames = ngames;
+    batch.walls.resize(LEVEL_LEN * ngames);
+    batch.hurdles.resize(LEVEL_LEN * ngames);
+    batch.nlanes.resize(ngames);
+    batch.lane.assign(ngames, 0);
+    batch.alive.assign(ngames, 1);
+    batch.diedAt.assign(ngames, LEVEL_LEN);
+    for (int g = 0; g < ngames; ++g) {
+        const Level &level = *levels[g];
+        batch.nlanes[g] = level.nlanes;
+        for (int b = 0; b < LEVEL_LEN; ++b) {
+            batch.walls[b * ngames + g] = level.walls[b];
+            batch.hurdles[b * ngames + g] = level.hurdles[b];
+        }
+    }
+}
+
+// Applies inputs[game] to games [first, last), landing on the given beat.
+// The same rules as PlayMove() and CheckCollision(), without branches.
+void StepBatch(GameBatch &batch, int beat, const uint8_t *inputs, int first, int last)
+{
+    const uint16_t *walls = &batch.walls[beat * batch.ngames];
+    const uint16_t *hurdles = &batch.hurdles[beat * batch.ngames];
+    const uint8_t *nlanes = batch.nlanes.data();
+    uint8_t *lane = batch.lane.data();
+    uint8_t *alive = batch.alive.data();
+    uint16_t *diedAt = batch.diedAt.data();
+
+    for (int g = first; g < last; ++g) {
+        int n = nlanes[g];
+        int input = inputs[g];
+        int l = lane[g];
+        int moved = l + (input == INPUT_LEFT) - (input == INPUT_RIGHT);
+        moved += n * (moved < 0) - n * (moved >= n);
+
+        int wall = walls[g] >> moved & 1;
+        int hurdle = hurdles[g] >> moved & 1;
+        int hurdling = input == INPUT_HURDLE;
+        int dies = wall | (hurdle ^ hurdling);
+
+        int a = alive[g];
+        lane[g] = a ? moved : l;
+        diedAt[g] = a & dies ? beat : diedAt[g];
+        alive[g] = a & !dies;
+    }
+}
+
+// Plays games [first, last) through a whole level, with the inputs for the
+// input landing on beat b at inputs[(b - 1) * ngames].
+void RunBatch(GameBatch &batch, const uint8_t *inputs, int first, int last)
+{
+    for (int b = 1; b < LEVEL_LEN; ++b) {
+        StepBatch(batch, b, inputs + (b - 1) * batch.ngames, first, last);
+    }
+}
+
+// --batch-benchmark N: play N games at once, on distinct generated levels
+// with the bot's inputs (every fourth game with random ones instead), check
+// them against PlayMove() and report the rate.
+int batchGames = 0;
+const int BATCH_REPEATS = 10;
+
+bool BatchBenchmark()
+{
+    std::shared_ptr<const PatternLibrary> lib = CurrentPatterns();
+    int ngames = batchGames;
+    std::vector<std::shared_ptr<const Level>> levels(ngames);
+    std::vector<uint8_t> inputs((LEVEL_LEN - 1) * ngames, INPUT_STAY);
+    std::vector<int> plan;
+    std::minstd_rand r(rng());
+    for (int g = 0; g < ngames; ++g) {
+        std::shared_ptr<const Level> level = GenerateLevel(lib.get());
+        levels[g] = level;
+        bool planned = g % 4 != 3 && PlanPath(*level, 0, 0, plan);
+        for (int b = 0; b < LEVEL_LEN - 1; ++b) {
+            inputs[b * ngames + g] = planned ? plan[b] : std::uniform_int_distribution<int>(INPUT_LEFT, INPUT_HURDLE)(r);
+        }
+    }
+
+    GameBatch batch;
+    int nthreads = 1;
+#ifdef DH_THREADS
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+#endif
+
+    double best = HUGE_VAL;
+    for (int rep = 0; rep < BATCH_REPEATS; ++rep) {
+        InitBatch(batch, levels);
+        Uint64 t0 = SDL_GetPerformanceCounter();
+#ifdef DH_THREADS
+        std::vector<std::thread> workers;
+        for (int t = 1; t < nthreads; ++t) {
+            workers.push_back(std::thread(RunBatch, std::ref(batch), inputs.data(), ngames * t / nthreads, ngames * (t + 1) / nthreads));
+        }
+        RunBatch(batch, inputs.data(), 0, ngames / nthreads);
+        for (std::thread &w : workers) w.join();
+#else
+        RunBatch(batch, inputs.data(), 0, ngames);
+#endif
+        best = std::min(best, static_cast<double>(SDL_GetPerformanceCounter() - t0) / SDL_GetPerformanceFrequency());
+    }
+
+    // Check every game against the one-at-a-time simulation.
+    int mismatched = 0, survived = 0;
+    GameState s = GameState();
+    for (int g = 0; g < ngames; ++g) {
+        s.level = levels[g];
+        s.offset = 0;
+        s.playerLane = 0;
+        s.playerAlive = true;
+        s.playerHurdling = false;
+        for (int b = 0; b < LEVEL_LEN - 1 && s.playerAlive; ++b) PlayMove(s, inputs[b * ngames + g], 0);
+        int diedAt = s.playerAlive ? LEVEL_LEN : s.offset;
+        if (s.playerAlive != (batch.alive[g] != 0) || diedAt != batch.diedAt[g] ||
+                (s.playerAlive && s.playerLane != batch.lane[g])) {
+            ++mismatched;
+        }
+        survived += s.playerAlive;
+    }
+
+    double gameBeats = static_cast<double>(ngames) * (LEVEL_LEN - 1);
+    std::printf("%d games (%d survived) on %d threads: %.1f million game-beats per second\n",
+        ngames, survived, nthreads, gameBeats / best / 1e6);
+    if (mismatched) std::printf("failed: %d games differ from PlayMove()\n", mismatched);
+    return mismatched == 0;
+}
+
+// Fuzzing: runs an arbitrary pattern file, text or pack, through loading,
+// generation, analysis and the bot. Nothing on this path may exit, so bad
+// input has to come back as an error from the loader. make fuzz-patterns
+// builds it as a libFuzzer target; --fuzz-replay runs saved inputs through
+// it in an ordinary build.
+void FuzzPatterns(const uint8_t *data, size_t size)
+{
+    PatternLibrary lib;
+    LoadError err;
+    if (!LoadPatternsFromMemory(data, size, lib, err)) return;
+
+    rng.seed(1);
+    std::shared_ptr<Level> level = GenerateLevel(&lib);
+    Difficulty d = AnalyzeLevel(*level);
+
+    // The analysis and the bot must agree, and the bot must live.
+    std::vector<int> inputs;
+    if (PlanPath(*level, 0, 0, inputs) != d.survivable) abort();
+    if (!d.survivable) return;
+    GameState g = GameState();
+    g.level = level;
+    g.playerAlive = true;
+    for (int input : inputs) PlayMove(g, input, 0);
+    if (!g.playerAlive) abort();
+}
+
+#ifdef DH_FUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    FuzzPatterns(data, size);
+    return 0;
+}
+#endif
+
+std::vector<const char *> fuzzReplayPaths;
+
+void FuzzReplay()
+{
+    for (const char *path : fuzzReplayPaths) {
+        std::string data;
+        if (!ReadWholeFile(path, data)) failAny("could not read fuzz input");
+        PatternLibrary lib;
+        LoadError err;
+        err.file = path;
+        if (LoadPatternsFromMemory(data.data(), data.size(), lib, err)) std::printf("%s: ok\n", path);
+        else std::printf("%s\n", DescribeLoadError(err).c_str());
+        FuzzPatterns(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    }
+}
+
+// --bot BPM: the bot plays the game on screen, one input per beat. It plans
+// whenever a new level appears and restarts when it dies or finishes.
+double botBpm = 0;
+std::shared_ptr<const Level> botLevel;
+std::vector<int> botInputs;
+size_t botNext;
+bool botPlanned;
+bool botAwaitingLevel;
+Uint64 botNextBeat;
+
+void BotTick()
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now < botNextBeat || !view.level) return;
+    Uint64 period = static_cast<Uint64>(SDL_GetPerformanceFrequency() * 60 / botBpm);
+    botNextBeat = std::max(botNextBeat + period, now);
+
+    if (view.level != botLevel) {
+        botLevel = view.level;
+        botAwaitingLevel = false;
+        botNext = 0;
+        botPlanned = PlanPath(*botLevel, view.offset, view.playerLane, botInputs);
+        if (!botPlanned) std::printf("bot: this level can't be survived\n");
+    }
+    if (botAwaitingLevel) return;
+
+    // Inputs queue in order, so the plan holds even while the view lags.
+    if (view.playerAlive && botPlanned && botNext >= botInputs.size() && PatternFileCount() > 1) {
+        // Hyper mode: once the view shows the plan played out, the next
+        // input starts the next section. Until then a death may be on its
+        // way, which calls for a restart instead.
+        if (view.offset < LEVEL_LEN - 1) return;
+        SubmitInput(INPUT_STAY, now);
+        botAwaitingLevel = true;
+    } else if (!view.playerAlive || botNext >= botInputs.size()) {
+        SubmitInput(INPUT_RESTART, now);
+        botAwaitingLevel = true;
+    } else {
+        SubmitInput(botInputs[botNext++], now);
+    }
+    lastInput_ms = SDL_GetTicks();
+}
+
+// Renderer-side queries, against the snapshot being drawn.
+int GetIncomingBandType(int lane, int bandNum)
+{
+    return GetIncomingBandType(view, lane, bandNum);
+}
+
+bool IsBandPlayer(int lane, int bandNum)
+{
+    return lane == view.playerLane && bandNum == 0;
+}
+
+bool BandHalfParity(int bandNum)
+{
+    return ((view.offset + bandNum) / 2) % 2;
+}
+
+const double ANIM_PER_SEC = 240.0;
+const double ANIM_PER_MS = ANIM_PER_SEC / 1000.0;
+
+#if DH_WITH_HUD
+void DrawText(const char *s, SDL_Color color, int x, int y, int *textW, int *textH, bool center = false)
+{
+    int tW, tH;
+    if (textW == NULL) textW = &tW;
+    if (textH == NULL) textH = &tH;
+
+    sdl_ptr<SDL_Surface> textSurf(TTF_RenderText_Solid(font, s, color));
+    if (!textSurf) failTTF("TTF_RenderText_Solid");
+
+    sdl_ptr<SDL_Texture> textTex(SDL_CreateTextureFromSurface(ren, textSurf.get()));
+    if (!textTex) failSDL("SDL_CreateTextureFromSurface");
+
+    if (SDL_QueryTexture(textTex.get(), NULL, NULL, textW, textH) < 0) failSDL("SDL_QueryTexture");
+
+    if (center) {
+        x -= *textW / 2;
+        y -= *textH / 2;
+    }
+
+    SDL_Rect dst = { x, y, *textW, *textH };
+    if (SDL_RenderCopy(ren, textTex.get(), NULL, &dst) < 0) failSDL("SDL_RenderCopy");
+}
+#endif
+
+const uint32_t DARK_RED = 0x471205FF;
+const uint32_t MEDIUM_RED = 0x6A1A07FF;
+const uint32_t LIGHT_RED = 0xC1161EFF;
+const uint32_t VERY_LIGHT_RED = 0xFF7780FF;
+
+const uint32_t LIGHT_GREEN = 0x1fc116FF;
+
+void update()
+{
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) {
+            quitRequested = true;
+        }
+        
+        if (e.type == SDL_KEYDOWN) {
+            lastInput_ms = SDL_GetTicks();
+            Uint64 now = SDL_GetPerformanceCounter();
+
+            SDL_Keycode sym = e.key.keysym.sym;
+            if (sym == SDLK_BACKSPACE) {
+                SubmitInput(INPUT_RESTART, now);
+            } else if (sym == SDLK_TAB) {
+                SubmitInput(INPUT_NEXT_PATTERNS, now);
+            } else if (sym == SDLK_LEFT || sym == SDLK_s) {
+                SubmitInput(INPUT_LEFT, now);
+            } else if (sym == SDLK_RIGHT || sym == SDLK_f) {
+                SubmitInput(INPUT_RIGHT, now);
+            } else if (sym == SDLK_UP || sym == SDLK_e) {
+                SubmitInput(INPUT_STAY, now);
+            } else if (sym == SDLK_DOWN || sym == SDLK_d) {
+                SubmitInput(INPUT_HURDLE, now);
+            }
+        }
+    }
+
+    if (botBpm > 0) BotTick();
+}
+
+// Pick up the newest simulation state and make sure the geometry tables
+// match its lane count.
+void FetchState()
+{
+    if (published.Fetch()) view = published.Front();
+
+    if (view.level->nlanes != nlanes) {
+        geometry = GetGeometry(view.level->nlanes);
+        nlanes = geometry->nlanes;
+    }
+
+    // An early input's animation waits for its beat.
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 since = now > view.advanceTime ? (now - view.advanceTime) * 1000 / SDL_GetPerformanceFrequency() : 0;
+    timeSinceAdvance_ms = static_cast<Uint32>(std::min<Uint64>(since, 1000000));
+}
+
+uint32_t * pixels;
+int pitch;
+
+void SetRenderScale(double scale)
+{
+    renderScale = std::min(std::max(scale, RENDER_SCALE_MIN), RENDER_SCALE_MAX);
+    renderW = std::max(1, static_cast<int>(round(WIDTH * renderScale)));
+    renderH = std::max(1, static_cast<int>(round(HEIGHT * renderScale)));
+
+    // Sample the precomputed tables at the centre of each scaled pixel.
+    for (int x = 0; x < renderW; ++x) {
+        renderSrcX[x] = std::min(static_cast<int>((x + 0.5) * WIDTH / renderW), WIDTH - 1);
+    }
+    for (int y = 0; y < renderH; ++y) {
+        renderSrcY[y] = std::min(static_cast<int>((y + 0.5) * HEIGHT / renderH), HEIGHT - 1);
+    }
+}
+
+// Pick the scale whose shading cost fits in what is left of the frame budget
+// once the fixed (upload, text, present) cost is paid. Shading cost is tracked
+// per pixel so the estimate stays valid across scale changes.
+void UpdateRenderScale()
+{
+    if (shadeAvgTimePerPixel_ms <= 0) return;
+
+    // When pipelined, shading overlaps the rest of the frame instead of
+    // adding to it.
+    double fixed_ms = pipelinedRender ? 0 : std::max(frameAvgTime_ms - shadeAvgTime_ms, 0.0);
+    double budget_ms = std::max(targetFrame_ms - fixed_ms, 0.1 * targetFrame_ms);
+
+    double ideal = sqrt(budget_ms / (shadeAvgTimePerPixel_ms * WIDTH * HEIGHT));
+    ideal = std::min(std::max(ideal, RENDER_SCALE_MIN), RENDER_SCALE_MAX);
+
+    // Ignore small changes so the image doesn't shimmer between neighbouring
+    // sizes. Drop straight to the ideal when over budget, but climb back
+    // gradually.
+    if (fabs(ideal - renderScale) * WIDTH < 4) return;
+    double next = ideal;
+    if (ideal > renderScale) {
+        next = renderScale + 0.25 * (ideal - renderScale);
+        if ((next - renderScale) * WIDTH < 4) next = ideal;
+    }
+    SetRenderScale(next);
+}
+
+// Colour of the playfield at a given distance down a lane.
+inline uint32_t ShadeAt(int lane, double dist, int bandNum, int tween)
+{
+    uint32_t color = lane % 2 ? DARK_RED : MEDIUM_RED;
+
+    const int INNER_BORDER = INNER_SPREAD + BORDER_SIZE;
+    if (dist < INNER_SPREAD) {
+        color = DARK_RED;
+    } else if (dist < INNER_BORDER) {
+        color = LIGHT_RED;
+    } else {
+        double outerDist = dist - INNER_BORDER;
+        double inBandDist = outerDist - BAND_SIZE * bandNum;
+
+        for (int dband = 0; dband <= 1; ++dband) {
+            int t = GetIncomingBandType(lane, bandNum - dband);
+            if (t != BAND_TYPE_NONE) {
+                uint32_t bandColor = LIGHT_RED;
+                if (t == BAND_TYPE_HURDLE) bandColor = LIGHT_GREEN;
+
+                int thickness = GetIncomingBandType(lane, bandNum + 1 - dband) == t ? BAND_SIZE : BAND_THICKNESS;
+                if (inBandDist + dband * BAND_SIZE < thickness + tween && inBandDist + dband * BAND_SIZE >= tween) color = bandColor;
+            }
+        }
+
+        if (IsBandPlayer(lane, bandNum) && inBandDist >= BAND_SIZE - BAND_THICKNESS) {
+            color = VERY_LIGHT_RED;
+        }
+    }
+
+    return color;
+}
+
+inline uint32_t ShadeAt(int lane, double dist, int tween)
+{
+    const int INNER_BORDER = INNER_SPREAD + BORDER_SIZE;
+    int bandNum = dist >= INNER_BORDER ? static_cast<int>((dist - INNER_BORDER) / BAND_SIZE) : 0;
+    return ShadeAt(lane, dist, bandNum, tween);
+}
+
+// Mix two RGBA8888 colours, taking weight/256 of a.
+inline uint32_t BlendColor(uint32_t a, uint32_t b, int weight)
+{
+    uint32_t rb = ((a >> 8) & 0x00FF00FF) * weight + ((b >> 8) & 0x00FF00FF) * (256 - weight);
+    uint32_t ga = (a & 0x00FF00FF) * weight + (b & 0x00FF00FF) * (256 - weight);
+    return (rb & 0xFF00FF00) | ((ga >> 8) & 0x00FF00FF);
+}
+
+// Distance from a position within a band to the nearest place where a band
+// or the player marker can start or end, i.e. to the nearest edge. Returns
+// the edge position through edge.
+inline double NearestBandEdge(double inBandDist, int tween, double *edge)
+{
+    const double candidates[4] = { 0, static_cast<double>(tween),
+        static_cast<double>((tween + BAND_THICKNESS) % BAND_SIZE), static_cast<double>(BAND_SIZE - BAND_THICKNESS) };
+    double best = BAND_SIZE;
+    for (int i = 0; i < 4; ++i) {
+        double d = inBandDist - candidates[i];
+        if (d > BAND_SIZE / 2) d -= BAND_SIZE;
+        if (d < -BAND_SIZE / 2) d += BAND_SIZE;
+        if (fabs(d) < fabs(best)) best = d;
+    }
+    *edge = inBandDist - best;
+    return best;
+}
+
+// Anti-aliased colour at one pixel. Every edge in the playfield is either a
+// lane boundary or a line of constant distance down a lane; distance has unit
+// gradient, so the signed distance to a radial edge is just the difference in
+// distance. Coverage of a pixel by the side it centres on is then
+// 0.5 + distance / pixelSize, and only pixels within half a pixel of an edge
+// need a second colour.
+inline uint32_t ShadeAntialiasedAt(int lane, double dist, int bandNum, int tween, double halfPixel)
+{
+    uint32_t color = ShadeAt(lane, dist, bandNum, tween);
+
+    const int INNER_BORDER = INNER_SPREAD + BORDER_SIZE;
+    double edge;
+    double edgeDist;
+    if (dist < INNER_BORDER) {
+        edge = dist < (INNER_SPREAD + INNER_BORDER) / 2.0 ? INNER_SPREAD : INNER_BORDER;
+        edgeDist = dist - edge;
+    } else {
+        double inBandDist = dist - INNER_BORDER - BAND_SIZE * bandNum;
+        edgeDist = NearestBandEdge(inBandDist, tween, &edge);
+        edge = dist - edgeDist;
+    }
+
+    if (fabs(edgeDist) < halfPixel) {
+        double across = edge + (edgeDist < 0 ? halfPixel : -halfPixel) * 0.5;
+        uint32_t other = ShadeAt(lane, across, tween);
+        if (other != color) {
+            int weight = static_cast<int>(256 * (0.5 + fabs(edgeDist) / (2 * halfPixel)));
+            color = BlendColor(color, other, weight);
+        }
+    }
+
+    return color;
+}
+
+// Away from lane boundaries the colour only depends on lane and distance, so
+// each frame it is tabulated per lane at sub-pixel steps of distance, and most
+// pixels become a single lookup. Band edges fall on whole distances, so the
+// aliased table is exact; the anti-aliased one is sampled at step centres.
+const int PROFILE_STEPS = 8;
+const int PROFILE_LEN = SIZE * PROFILE_STEPS;
+uint32_t colorProfile[LANES_MAX][PROFILE_LEN];
+
+inline int ProfileIndex(double dist)
+{
+    int i = static_cast<int>(dist * PROFILE_STEPS);
+    return std::min(std::max(i, 0), PROFILE_LEN - 1);
+}
+
+void BuildColorProfile(int tween, double halfPixel)
+{
+    const int INNER_BORDER = INNER_SPREAD + BORDER_SIZE;
+    for (int lane = 0; lane < nlanes; ++lane) {
+        for (int i = 0; i < PROFILE_LEN; ++i) {
+            double dist = (i + (antialias ? 0.5 : 0.0)) / PROFILE_STEPS;
+            int bandNum = dist >= INNER_BORDER ? static_cast<int>((dist - INNER_BORDER) / BAND_SIZE) : 0;
+            colorProfile[lane][i] = antialias ? ShadeAntialiasedAt(lane, dist, bandNum, tween, halfPixel) : ShadeAt(lane, dist, bandNum, tween);
+        }
+    }
+}
+
+// Rasterize the playfield on the CPU into the top-left renderW x renderH of
+// out, which has rows WIDTH pixels apart.
+void ShadeCanvas(uint32_t *out)
+{
+    Uint64 shadeStart = SDL_GetPerformanceCounter();
+    const Geometry &geo = *geometry;
+
+    int tween = std::max(BAND_SIZE - static_cast<int>(round(ANIM_PER_MS * timeSinceAdvance_ms)), 0);
+    // Half the size of a scaled pixel, in table units.
+    double halfPixel = 0.5 / renderScale;
+    if (antialias || rotateCamera) BuildColorProfile(tween, halfPixel);
+
+    // Draw
+    for (int ry = 0; ry < renderH; ++ry) {
+        int y = renderSrcY[ry];
+        uint32_t *row = out + ry*WIDTH;
+
+        if (rotateCamera) {
+            for (int rx = 0; rx < renderW; ++rx) {
+                int x = renderSrcX[rx];
+                uint32_t pos = static_cast<uint16_t>(angleAt[y][x] - cameraAngle) * nlanes + 0x8000;
+                int lane = pos >> 16;
+                if (lane == nlanes) lane = 0;
+                int frac = (pos & 0xFFFF) >> (16 - LANE_FRAC_BITS);
+                float radius = radiusAt[y][x];
+                uint32_t color = colorProfile[lane][ProfileIndex(radius * geo.laneCosAt[frac])];
+
+                double laneEdgeDist = radius * geo.laneEdgeSinAt[frac];
+                if (antialias && laneEdgeDist < halfPixel) {
+                    int neighbor = (lane + (frac >= LANE_FRAC_LEN / 2 ? 1 : nlanes - 1)) % nlanes;
+                    uint32_t other = colorProfile[neighbor][ProfileIndex(radius * geo.neighborCosAt[frac])];
+                    if (other != color) {
+                        int weight = static_cast<int>(256 * (0.5 + laneEdgeDist / (2 * halfPixel)));
+                        color = BlendColor(color, other, weight);
+                    }
+                }
+                row[rx] = color;
+            }
+            continue;
+        }
+
+        if (!antialias) {
+            for (int rx = 0; rx < renderW; ++rx) {
+                int x = renderSrcX[rx];
+                row[rx] = ShadeAt(geo.laneAt[y][x], geo.distAt[y][x], geo.bandNumAt[y][x], tween);
+            }
+            continue;
+        }
+
+        for (int rx = 0; rx < renderW; ++rx) {
+            int x = renderSrcX[rx];
+            uint32_t color = colorProfile[geo.laneAt[y][x]][ProfileIndex(geo.distAt[y][x])];
+
+            int neighbor = geo.neighborLaneAt[y][x];
+            double laneEdgeDist = geo.laneEdgeDistAt[y][x];
+            if (neighbor >= 0 && laneEdgeDist < halfPixel) {
+                uint32_t other = colorProfile[neighbor][ProfileIndex(geo.neighborDistAt[y][x])];
+                if (other != color) {
+                    int weight = static_cast<int>(256 * (0.5 + laneEdgeDist / (2 * halfPixel)));
+                    color = BlendColor(color, other, weight);
+                }
+            }
+
+            row[rx] = color;
+        }
+    }
+
+    double shade_ms = 1000.0 * (SDL_GetPerformanceCounter() - shadeStart) / SDL_GetPerformanceFrequency();
+    shadeAvgTime_ms = scaleAvg_decay * shadeAvgTime_ms + (1-scaleAvg_decay) * shade_ms;
+    shadeAvgTimePerPixel_ms = scaleAvg_decay * shadeAvgTimePerPixel_ms + (1-scaleAvg_decay) * shade_ms / (renderW * renderH);
+}
+
+void BlitCanvas(const uint32_t *src, int w, int h)
+{
+    SDL_Rect rect = { 0, 0, w, h };
+    SDL_UpdateTexture(canvas.get(), &rect, src, pitch);
+
+    if (SDL_RenderCopy(ren, canvas.get(), &rect, NULL) < 0) failSDL("SDL_RenderCopy canvas");
+}
+
+// Pipelined rendering: while the main thread uploads and presents one frame,
+// the shading thread rasterizes the next into the other buffer. The shading
+// thread reads the render globals (view, geometry tables, scale, camera), so
+// the main thread only changes them between FinishShading() and the next
+// frame's RenderCanvasPipelined().
+uint32_t *pixelBuffers[2];
+
+struct ShadedFrame
+{
+    bool valid;
+    int w;
+    int h;
+    GameState state;
+};
+ShadedFrame shadedFrames[2];
+int shadeBuffer;
+
+#ifdef DH_THREADS
+std::thread shadeThread;
+SDL_sem *shadeStart = NULL;
+SDL_sem *shadeDone = NULL;
+std::atomic<bool> shadeQuit(false);
+bool shadeBusy = false;
+
+void ShadeThread()
+{
+    while (true) {
+        SDL_SemWait(shadeStart);
+        if (shadeQuit.load()) break;
+        ShadeCanvas(pixelBuffers[shadeBuffer]);
+        SDL_SemPost(shadeDone);
+    }
+}
+#endif
+
+void StartShadeThread()
+{
+#ifdef DH_THREADS
+    pixelBuffers[0] = pixels;
+    pixelBuffers[1] = new uint32_t[HEIGHT * WIDTH];
+
+    shadeStart = SDL_CreateSemaphore(0);
+    shadeDone = SDL_CreateSemaphore(0);
+    if (!shadeStart || !shadeDone) failSDL("SDL_CreateSemaphore");
+    shadeThread = std::thread(ShadeThread);
+#endif
+}
+
+void FinishShading()
+{
+#ifdef DH_THREADS
+    if (shadeBusy) {
+        SDL_SemWait(shadeDone);
+        shadeBusy = false;
+    }
+#endif
+}
+
+void StopShadeThread()
+{
+#ifdef DH_THREADS
+    if (shadeThread.joinable()) {
+        FinishShading();
+        shadeQuit.store(true);
+        SDL_SemPost(shadeStart);
+        shadeThread.join();
+    }
+    if (shadeStart) SDL_DestroySemaphore(shadeStart);
+    if (shadeDone) SDL_DestroySemaphore(shadeDone);
+    shadeStart = shadeDone = NULL;
+#endif
+}
+
+void PresentFrame(const GameState &shown);
+
+// Hand the current state to the shading thread, then present the frame it
+// finished last time. This puts one extra frame between input and display,
+// in exchange for overlapping shading with upload and present.
+void RenderCanvasPipelined()
+{
+#ifdef DH_THREADS
+    int ready = shadeBuffer;
+    shadeBuffer = 1 - shadeBuffer;
+
+    ShadedFrame &next = shadedFrames[shadeBuffer];
+    next.valid = true;
+    next.w = renderW;
+    next.h = renderH;
+    next.state = view;
+    shadeBusy = true;
+    SDL_SemPost(shadeStart);
+
+    const ShadedFrame &frame = shadedFrames[ready];
+    if (!frame.valid) return;
+    BlitCanvas(pixelBuffers[ready], frame.w, frame.h);
+    PresentFrame(frame.state);
+#endif
+}
+
+std::vector<SDL_Vertex> geomVerts;
+std::vector<int> geomIndices;
+
+SDL_Color ToSDLColor(uint32_t c)
+{
+    SDL_Color color = { Uint8(c >> 24), Uint8(c >> 16), Uint8(c >> 8), Uint8(c) };
+    return color;
+}
+
+// Queue the part of a lane lying between two distances down the lane. Edges
+// of constant distance are perpendicular to the lane, so this is a trapezoid
+// between the lane's two wedge boundaries.
+void AddLaneQuad(int lane, double dist0, double dist1, uint32_t c)
+{
+    double halfWedge = M_PI / nlanes;
+    double rho = lane * (2.0 * M_PI / nlanes) + (rotateCamera ? cameraAngle * (2.0 * M_PI / 65536.0) : 0);
+    double cx = WIDTH / 2.0;
+    double cy = HEIGHT / 2.0;
+    SDL_Color color = ToSDLColor(c);
+
+    int base = static_cast<int>(geomVerts.size());
+    double dists[2] = { dist0, dist1 };
+    for (int i = 0; i < 2; ++i) {
+        double r = dists[i] / cos(halfWedge);
+        for (int side = -1; side <= 1; side += 2) {
+            double theta = rho + side * halfWedge;
+            SDL_Vertex v;
+            v.position.x = static_cast<float>(cx - r * sin(theta));
+            v.position.y = static_cast<float>(cy - r * cos(theta));
+            v.color = color;
+            v.tex_coord.x = 0;
+            v.tex_coord.y = 0;
+            geomVerts.push_back(v);
+        }
+    }
+
+    const int QUAD[6] = { 0, 1, 2, 1, 3, 2 };
+    for (int i = 0; i < 6; ++i) geomIndices.push_back(base + QUAD[i]);
+}
+
+// Draw the playfield as flat-coloured triangles in a single draw call. Covers
+// the same regions, in the same order, as the per-pixel rules of
+// ShadeCanvas() and ShadeAt().
+void RenderGeometry()
+{
+    geomVerts.clear();
+    geomIndices.clear();
+
+    const int INNER_BORDER = INNER_SPREAD + BORDER_SIZE;
+    // Beyond the window corners.
+    const double FAR_DIST = SIZE;
+
+    int tween = std::max(BAND_SIZE - static_cast<int>(round(ANIM_PER_MS * timeSinceAdvance_ms)), 0);
+
+    for (int lane = 0; lane < nlanes; ++lane) {
+        AddLaneQuad(lane, 0, FAR_DIST, lane % 2 ? DARK_RED : MEDIUM_RED);
+        AddLaneQuad(lane, 0, INNER_SPREAD, DARK_RED);
+        AddLaneQuad(lane, INNER_SPREAD, INNER_BORDER, LIGHT_RED);
+
+        for (int bandNum = -1; INNER_BORDER + bandNum * BAND_SIZE + tween < FAR_DIST; ++bandNum) {
+            int t = GetIncomingBandType(lane, bandNum);
+            if (t == BAND_TYPE_NONE) continue;
+
+            uint32_t bandColor = LIGHT_RED;
+            if (t == BAND_TYPE_HURDLE) bandColor = LIGHT_GREEN;
+
+            int thickness = GetIncomingBandType(lane, bandNum + 1) == t ? BAND_SIZE : BAND_THICKNESS;
+            double start = INNER_BORDER + bandNum * BAND_SIZE + tween;
+            double end = start + thickness;
+            // Bands never cover the inner border.
+            start = std::max<double>(start, INNER_BORDER);
+            if (start < end) AddLaneQuad(lane, start, end, bandColor);
+        }
+    }
+
+    AddLaneQuad(view.playerLane, INNER_BORDER + BAND_SIZE - BAND_THICKNESS, INNER_BORDER + BAND_SIZE, VERY_LIGHT_RED);
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    if (SDL_RenderGeometry(ren, NULL, geomVerts.data(), static_cast<int>(geomVerts.size()),
+            geomIndices.data(), static_cast<int>(geomIndices.size())) < 0) {
+        failSDL("SDL_RenderGeometry");
+    }
+#endif
+}
+
+Uint64 drawEnd;
+
+// Latencies in LATENCY_BUCKET_MS buckets, with the last bucket catching
+// everything beyond.
+const double LATENCY_BUCKET_MS = 0.5;
+const int LATENCY_BUCKETS = 200;
+
+struct LatencyHistogram
+{
+    Uint64 counts[LATENCY_BUCKETS];
+    Uint64 total;
+    double sum_ms;
+    double max_ms;
+
+    void Add(double ms)
+    {
+        int bucket = std::min(static_cast<int>(ms / LATENCY_BUCKET_MS), LATENCY_BUCKETS - 1);
+        ++counts[bucket];
+        ++total;
+        sum_ms += ms;
+        max_ms = std::max(max_ms, ms);
+    }
+
+    // Upper edge of the bucket containing the given fraction of samples.
+    double Percentile(double fraction) const
+    {
+        Uint64 target = static_cast<Uint64>(ceil(fraction * total));
+        Uint64 seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS - 1; ++i) {
+            seen += counts[i];
+            if (seen >= target) return (i + 1) * LATENCY_BUCKET_MS;
+        }
+        return max_ms;
+    }
+
+    void Print(const char *name) const
+    {
+        std::printf("%s: %llu inputs\n", name, static_cast<unsigned long long>(total));
+        if (total == 0) return;
+        std::printf("  mean %.2f ms, p50 <= %.1f ms, p90 <= %.1f ms, p99 <= %.1f ms, max %.2f ms\n",
+            sum_ms / total, Percentile(0.5), Percentile(0.9), Percentile(0.99), max_ms);
+
+        Uint64 peak = *std::max_element(counts, counts + LATENCY_BUCKETS);
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+            if (counts[i] == 0) continue;
+            int bar = static_cast<int>(50 * counts[i] / peak);
+            if (i == LATENCY_BUCKETS - 1) {
+                std::printf("  >=%5.1f ms %6llu %s\n", i * LATENCY_BUCKET_MS, static_cast<unsigned long long>(counts[i]), std::string(bar, '#').c_str());
+            } else {
+                std::printf("  %5.1f ms %8llu %s\n", i * LATENCY_BUCKET_MS, static_cast<unsigned long long>(counts[i]), std::string(bar, '#').c_str());
+            }
+        }
+    }
+};
+
+// Input latency measurement: from polling a key to the state change being
+// applied by the simulation, and to the first present showing it.
+LatencyHistogram pollToApply;
+LatencyHistogram pollToPresent;
+unsigned presentedInputSeq;
+
+void RecordPresentLatency(const GameState &shown, Uint64 presentTime)
+{
+    unsigned seq = shown.inputSeq;
+    if (seq - presentedInputSeq > INPUT_HISTORY) {
+        // More inputs than the snapshot remembers; skip the oldest.
+        presentedInputSeq = seq - INPUT_HISTORY;
+    }
+
+    double freq = static_cast<double>(SDL_GetPerformanceFrequency());
+    for (unsigned i = presentedInputSeq + 1; i - 1 != seq; ++i) {
+        int slot = i % INPUT_HISTORY;
+        pollToApply.Add(1000.0 * (shown.inputApplyTime[slot] - shown.inputPollTime[slot]) / freq);
+        pollToPresent.Add(1000.0 * (presentTime - shown.inputPollTime[slot]) / freq);
+    }
+    presentedInputSeq = seq;
+}
+
+void PrintLatencyReport()
+{
+    if (!measureLatency) return;
+    pollToApply.Print("Input to state latency");
+    pollToPresent.Print("Input to present latency");
+}
+
+void PresentFrame(const GameState &shown)
+{
+#if DH_WITH_HUD
+    if (!shown.playerAlive) {
+        DrawText("YOU DIED", { 255, 255, 255, 255 }, WIDTH / 2, HEIGHT / 2, NULL, NULL, true);
+    }
+
+    if (renderAvgDenom > 0) {
+        char buf[256];
+        if (renderScale < RENDER_SCALE_MAX) {
+            snprintf(buf, sizeof(buf), "Render avg: %.2lf ms (scale %.2lf)", renderAvgTime_ms / renderAvgDenom, renderScale);
+        } else {
+            snprintf(buf, sizeof(buf), "Render avg: %.2lf ms", renderAvgTime_ms / renderAvgDenom);
+        }
         DrawText(buf, { 255, 255, 255, 255 }, 0, 0, NULL, NULL);
     }
 
+    if (beatClock && !beatDetectDone.load() && musicSamples && beatBpm <= 0) {
+        DrawText("Detecting beats...", { 255, 255, 255, 255 }, 0, HEIGHT - FONT_HEIGHT - 4, NULL, NULL);
+    } else if (beatClock && shown.judgement != JUDGE_NONE) {
+        const char *JUDGE_NAMES[4] = { "", "PERFECT", "GOOD", "MISS" };
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s %+.0lf ms   perfect %d  good %d  miss %d",
+            JUDGE_NAMES[shown.judgement], shown.judgeError_ms,
+            shown.judgeCounts[JUDGE_PERFECT], shown.judgeCounts[JUDGE_GOOD], shown.judgeCounts[JUDGE_MISS]);
+        DrawText(buf, { 255, 255, 255, 255 }, 0, HEIGHT - FONT_HEIGHT - 4, NULL, NULL);
+    }
+#endif
+
+    // Excludes present, which blocks on vsync.
+    drawEnd = SDL_GetPerformanceCounter();
+    SDL_RenderPresent(ren);
+
+    if (measureLatency) RecordPresentLatency(shown, SDL_GetPerformanceCounter());
+}
+
+void render()
+{
+    if (rendererType == RENDERER_GEOMETRY) {
+        RenderGeometry();
+        PresentFrame(view);
+    } else if (pipelinedRender) {
+        RenderCanvasPipelined();
+    } else {
+        ShadeCanvas(pixels);
+        BlitCanvas(pixels, renderW, renderH);
+        PresentFrame(view);
+    }
+}
+
+// Ease the camera towards the player's lane along the shorter way round.
+void UpdateCamera(Uint32 dt_ms)
+{
+    double target = -static_cast<double>(view.playerLane) / nlanes;
+    double diff = remainder(target - cameraTurns, 1.0);
+    cameraTurns += diff * (1 - exp(-dt_ms / CAMERA_EASE_MS));
+    cameraTurns -= floor(cameraTurns);
+    cameraAngle = static_cast<uint16_t>(static_cast<uint32_t>(round(cameraTurns * 65536.0)));
+}
+
+bool IsAnimating()
+{
+    if (ANIM_PER_MS * timeSinceAdvance_ms < BAND_SIZE) return true;
+    if (rotateCamera && fabs(remainder(-static_cast<double>(view.playerLane) / nlanes - cameraTurns, 1.0)) * 65536 >= 1) return true;
+    return false;
+}
+
+// Wait until the next frame is due. Deadlines are kept on an absolute
+// timeline so that sleep rounding doesn't accumulate. SDL_Delay is coarse, so
+// it is only used for the bulk of the wait and the last LIMITER_SPIN_MS is
+// spun out. When nothing is moving the rate drops to POWER_SAVE_FPS, and the
+// wait is on the event queue so a keypress still wakes the game at once.
+void PaceFrame()
+{
+#ifndef __EMSCRIPTEN__
+    bool idle = powerSave && !IsAnimating() &&
+        (!view.playerAlive || SDL_GetTicks() - lastInput_ms >= IDLE_MS);
+
+    double fps = fpsCap;
+    if (idle) fps = fps > 0 ? std::min(fps, POWER_SAVE_FPS) : POWER_SAVE_FPS;
+    if (fps <= 0) return;
+
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 period = static_cast<Uint64>(freq / fps);
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    // Don't race to catch up after a long frame.
+    if (now > frameDeadline + period) frameDeadline = now;
+
+    while (now < frameDeadline) {
+        double remaining_ms = 1000.0 * (frameDeadline - now) / freq;
+        if (idle) {
+            if (SDL_WaitEventTimeout(NULL, static_cast<int>(ceil(remaining_ms)))) {
+                frameDeadline = SDL_GetPerformanceCounter();
+                break;
+            }
+        } else if (remaining_ms > LIMITER_SPIN_MS) {
+            SDL_Delay(static_cast<Uint32>(remaining_ms - LIMITER_SPIN_MS));
+        }
+        now = SDL_GetPerformanceCounter();
+    }
+
+    frameDeadline += period;
+#endif
+}
+
+// --profile-startup: time each step of startup and print them once the
+// first game frame is presented. Steps on the loader thread overlap the
+// main thread's, so each is listed with when it started as well as how
+// long it took.
+bool profileStartup = false;
+const int STARTUP_STEPS_MAX = 32;
+
+struct StartupStep
+{
+    const char *name;
+    const char *thread;
+    Uint64 start;
+    Uint64 end;
+};
+
+StartupStep startupSteps[STARTUP_STEPS_MAX];
+std::atomic<int> nstartupSteps(0);
+Uint64 startupOrigin;
+Uint64 firstPresentTime;
+
+// Records a step from start until now, and returns now so that steps can
+// be chained.
+Uint64 ProfileStep(const char *name, const char *thread, Uint64 start)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (!profileStartup) return now;
+    int i = nstartupSteps.fetch_add(1);
+    if (i < STARTUP_STEPS_MAX) {
+        StartupStep s = { name, thread, start, now };
+        startupSteps[i] = s;
+    }
+    return now;
+}
+
+void PrintStartupProfile()
+{
+    double ms = 1000.0 / SDL_GetPerformanceFrequency();
+    int n = std::min(nstartupSteps.load(), STARTUP_STEPS_MAX);
+    std::sort(startupSteps, startupSteps + n,
+        [](const StartupStep &a, const StartupStep &b) { return a.start < b.start; });
+
+    std::printf("startup step                  thread   start ms   took ms\n");
+    for (int i = 0; i < n; ++i) {
+        const StartupStep &s = startupSteps[i];
+        std::printf("%-28s  %-6s  %9.2f  %8.2f\n",
+            s.name, s.thread, (s.start - startupOrigin) * ms, (s.end - s.start) * ms);
+    }
+    std::printf("first frame presented at %.2f ms; first game frame at %.2f ms\n",
+        (firstPresentTime - startupOrigin) * ms, (SDL_GetPerformanceCounter() - startupOrigin) * ms);
+    fflush(stdout);
+}
+
+// Startup: the window comes up first and shows loading frames while the
+// font, patterns and the first level's geometry load on a thread. Without
+// threads they load in one go, after the first loading frame is presented.
+// The loader never exits: it leaves any failure in assetError for the main
+// thread to report once it has joined it.
+const int LOADING_FRAME_MS = 16;
+bool assetsReady = false;
+bool startupReported = false;
+std::atomic<bool> assetsLoaded(false);
+std::string assetError;
+#ifdef DH_THREADS
+std::thread assetThread;
+#endif
+
+void LoadAssets()
+{
+    Uint64 t = SDL_GetPerformanceCounter();
+#if DH_WITH_HUD
+    font = TTF_OpenFont("data/Vera.ttf", FONT_HEIGHT);
+    if (!font) {
+        assetError = std::string("TTF_OpenFont: ") + TTF_GetError();
+        assetsLoaded.store(true);
+        return;
+    }
+    t = ProfileStep("TTF_OpenFont", "loader", t);
+#endif
+
+    PrecomputeAngles();
+    t = ProfileStep("PrecomputeAngles", "loader", t);
+    LoadError err;
+    if (!LoadPatterns(err)) {
+        assetError = DescribeLoadError(err);
+        assetsLoaded.store(true);
+        return;
+    }
+    t = ProfileStep("ReadPatterns", "loader", t);
+    GetGeometry(Patterns(0)->nlanes);
+    ProfileStep("Precompute", "loader", t);
+    assetsLoaded.store(true);
+}
+
+void StartAssetLoad()
+{
+#ifdef DH_THREADS
+    assetThread = std::thread(LoadAssets);
+#endif
+}
+
+void StopAssetLoad()
+{
+#ifdef DH_THREADS
+    if (assetThread.joinable()) assetThread.join();
+#endif
+}
+
+// Just the background, so the window isn't left blank; only quitting is
+// handled.
+void LoadingFrame()
+{
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) quitRequested = true;
+    }
+
+    SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
+    SDL_RenderClear(ren);
     SDL_RenderPresent(ren);
+    if (!firstPresentTime) firstPresentTime = SDL_GetPerformanceCounter();
+    if (!vsync) SDL_Delay(LOADING_FRAME_MS);
+}
+
+// Starts the game once the assets are in. Returns whether it is running.
+bool FinishStartup()
+{
+#ifdef DH_THREADS
+    if (!assetsLoaded.load()) return false;
+    assetThread.join();
+#else
+    LoadAssets();
+#endif
+    if (!assetError.empty()) failAny(assetError.c_str());
+
+    Uint64 t = SDL_GetPerformanceCounter();
+    StartGeometryWorker();
+    StartPatternWatch();
+    StartSimulation();
+    if (musicPath) StartMusic();
+    ProfileStep("start threads, first level", "main", t);
+
+    prevFrame_ms = SDL_GetTicks();
+    lastInput_ms = prevFrame_ms;
+    frameDeadline = SDL_GetPerformanceCounter();
+    assetsReady = true;
+    return true;
 }
 
 void main_loop()
 {
+    if (!assetsReady && !FinishStartup()) {
+        LoadingFrame();
+        return;
+    }
+
     update();
+    FinishShading();
+    FetchState();
 
     // Delta time for animation
     Uint32 now_ms = SDL_GetTicks();
-    timeSinceAdvance_ms += now_ms - prevFrame_ms;
+    Uint32 dt_ms = now_ms - prevFrame_ms;
     prevFrame_ms = now_ms;
 
+    if (rotateCamera) UpdateCamera(dt_ms);
+    if (renderScaleAuto) UpdateRenderScale();
+
     // Render
-    Uint32 start_ms = SDL_GetTicks();
+    Uint64 start = SDL_GetPerformanceCounter();
     render();
-    Uint32 end_ms = SDL_GetTicks();
+    Uint64 end = SDL_GetPerformanceCounter();
+    if (profileStartup && !startupReported) {
+        ProfileStep("first game frame", "main", start);
+        PrintStartupProfile();
+        startupReported = true;
+    }
+    double frame_ms = 1000.0 * (end - start) / SDL_GetPerformanceFrequency();
 
-    renderAvgTime_ms = renderAvg_decay * renderAvgTime_ms + (1-renderAvg_decay) * (end_ms - start_ms);
+    renderAvgTime_ms = renderAvg_decay * renderAvgTime_ms + (1-renderAvg_decay) * frame_ms;
     renderAvgDenom = renderAvg_decay * renderAvgDenom + (1-renderAvg_decay);
+
+    double draw_ms = 1000.0 * (drawEnd - start) / SDL_GetPerformanceFrequency();
+    frameAvgTime_ms = scaleAvg_decay * frameAvgTime_ms + (1-scaleAvg_decay) * draw_ms;
+
+    PaceFrame();
+}
+
+void ParseArgs(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "--render-scale") && val) {
+            if (!strcmp(val, "auto")) {
+                renderScaleAuto = true;
+            } else {
+                renderScale = atof(val);
+                if (renderScale < RENDER_SCALE_MIN || RENDER_SCALE_MAX < renderScale) failAny("--render-scale out of bounds");
+            }
+            ++i;
+        } else if (!strcmp(arg, "--target-frame-ms") && val) {
+            targetFrame_ms = atof(val);
+            if (targetFrame_ms <= 0) failAny("--target-frame-ms must be positive");
+            ++i;
+        } else if (!strcmp(arg, "--scale-filter") && val) {
+            if (!strcmp(val, "nearest")) renderScaleFilter = SDL_ScaleModeNearest;
+            else if (!strcmp(val, "linear")) renderScaleFilter = SDL_ScaleModeLinear;
+            else failAny("--scale-filter must be nearest or linear");
+            ++i;
+        } else if (!strcmp(arg, "--renderer") && val) {
+            if (!strcmp(val, "cpu")) rendererType = RENDERER_CPU;
+            else if (!strcmp(val, "geometry")) rendererType = RENDERER_GEOMETRY;
+            else failAny("--renderer must be cpu or geometry");
+#if !SDL_VERSION_ATLEAST(2, 0, 18)
+            if (rendererType == RENDERER_GEOMETRY) failAny("--renderer geometry needs SDL 2.0.18 or later");
+#endif
+            ++i;
+        } else if (!strcmp(arg, "--software-renderer")) {
+            softwareRenderer = true;
+        } else if (!strcmp(arg, "--antialias")) {
+            antialias = true;
+        } else if (!strcmp(arg, "--rotate-camera")) {
+            rotateCamera = true;
+        } else if (!strcmp(arg, "--vsync")) {
+            vsync = true;
+        } else if (!strcmp(arg, "--fps-cap") && val) {
+            fpsCap = atof(val);
+            if (fpsCap < 0) failAny("--fps-cap must not be negative");
+            ++i;
+        } else if (!strcmp(arg, "--no-power-save")) {
+            powerSave = false;
+        } else if (!strcmp(arg, "--measure-latency")) {
+            measureLatency = true;
+        } else if (!strcmp(arg, "--profile-startup")) {
+            profileStartup = true;
+        } else if (!strcmp(arg, "--beat-clock") && val) {
+            ReadBeatClock(val);
+            ++i;
+        } else if (!strcmp(arg, "--music") && val) {
+            musicPath = val;
+            ++i;
+        } else if (!strcmp(arg, "--audio-buffer") && val) {
+            audioBufferFrames = atoi(val);
+            if (audioBufferFrames < 64 || audioBufferFrames > 8192 || (audioBufferFrames & (audioBufferFrames - 1))) {
+                failAny("--audio-buffer must be a power of two from 64 to 8192");
+            }
+            ++i;
+        } else if (!strcmp(arg, "--beat-strict")) {
+            beatStrict = true;
+        } else if (!strcmp(arg, "--patterns") && val) {
+            patternsPath = val;
+            ++i;
+        } else if (!strcmp(arg, "--hyper") && val) {
+            if (PatternFileCount() == PATTERN_FILES_MAX) failAny("too many --hyper pattern files");
+            hyperPaths.push_back(val);
+            ++i;
+        } else if (!strcmp(arg, "--target-difficulty") && i + 2 < argc) {
+            targetDifficulty = true;
+            targetFrom = atof(argv[i + 1]);
+            targetTo = atof(argv[i + 2]);
+            if (targetFrom < 0 || 1 < targetFrom || targetTo < 0 || 1 < targetTo) failAny("--target-difficulty must be between 0 and 1");
+            i += 2;
+        } else if (!strcmp(arg, "--bot") && val) {
+            botBpm = atof(val);
+            if (botBpm <= 0) failAny("--bot needs a positive BPM");
+            ++i;
+        } else if (!strcmp(arg, "--monte-carlo") && val) {
+            monteCarloGames = atoi(val);
+            if (monteCarloGames <= 0) failAny("--monte-carlo needs a positive number of games");
+            ++i;
+        } else if (!strcmp(arg, "--player-error") && val) {
+            playerError = atof(val);
+            ++i;
+        } else if (!strcmp(arg, "--player-miss") && val) {
+            playerMiss = atof(val);
+            ++i;
+        } else if (!strcmp(arg, "--player-stay-bias") && val) {
+            playerStayBias = atof(val);
+            ++i;
+        } else if (!strcmp(arg, "--batch-benchmark") && val) {
+            batchGames = atoi(val);
+            if (batchGames <= 0) failAny("--batch-benchmark needs a positive number of games");
+            ++i;
+        } else if (!strcmp(arg, "--bot-benchmark")) {
+            botBenchmark = true;
+        } else if (!strcmp(arg, "--analyze")) {
+            analyzePatterns = true;
+        } else if (!strcmp(arg, "--analyze-batch") && val) {
+            // Takes the rest of the arguments.
+            analyzeBatchPaths.assign(argv + i + 1, argv + argc);
+            break;
+        } else if (!strcmp(arg, "--fuzz-replay") && val) {
+            // Takes the rest of the arguments.
+            fuzzReplayPaths.assign(argv + i + 1, argv + argc);
+            break;
+        } else if (!strcmp(arg, "--compile-patterns") && i + 2 < argc) {
+            compileIn = argv[i + 1];
+            compileOut = argv[i + 2];
+            i += 2;
+        } else if (!strcmp(arg, "--pipelined-render")) {
+#ifdef DH_THREADS
+            pipelinedRender = true;
+#else
+            std::printf("--pipelined-render needs threads; ignoring\n");
+#endif
+        } else {
+            std::printf("unknown argument: %s\n", arg);
+            exit(1);
+        }
+    }
 }
 
+#ifndef DH_FUZZER
 int main(int argc, char *argv[])
 {
     std::atexit(cleanup);
+    ParseArgs(argc, argv);
+    if (compileOut) {
+        CompilePatterns();
+        return 0;
+    }
+    if (!fuzzReplayPaths.empty()) {
+        FuzzReplay();
+        return 0;
+    }
     std::srand(static_cast<unsigned>(std::time(0)));
     std::random_device rd;
     rng.seed(rd());
+    if (!analyzeBatchPaths.empty()) return AnalyzeBatch() ? 0 : 1;
+    if (analyzePatterns) {
+        LoadPatterns();
+        AnalyzePatterns();
+        return 0;
+    }
+    if (botBenchmark) {
+        LoadPatterns();
+        return BotBenchmark() ? 0 : 1;
+    }
+    if (batchGames) {
+        LoadPatterns();
+        return BatchBenchmark() ? 0 : 1;
+    }
+    if (monteCarloGames) {
+        if (playerError < 0 || playerMiss < 0 || playerError + playerMiss > 1) failAny("--player-error and --player-miss must be probabilities");
+        if (playerStayBias < 0 || 1 < playerStayBias) failAny("--player-stay-bias must be a probability");
+        LoadPatterns();
+        MonteCarlo();
+        return 0;
+    }
 
+    Uint64 t = startupOrigin = SDL_GetPerformanceCounter();
     if (SDL_Init(SDL_INIT_VIDEO) < 0) failSDL("SDL_Init");
+    t = ProfileStep("SDL_Init", "main", t);
+#if DH_WITH_HUD
     if (TTF_Init() == -1) failTTF("TTF_Init");
+    t = ProfileStep("TTF_Init", "main", t);
+#endif
 
+#if DH_WITH_IMAGE
     int flags = IMG_INIT_PNG;
     if ((IMG_Init(flags) & flags) != flags) failIMG("IMG_Init");
-
-    font = TTF_OpenFont("data/Vera.ttf", FONT_HEIGHT);
-    if (!font) failTTF("TTF_OpenFont");
+    t = ProfileStep("IMG_Init", "main", t);
+#endif
 
     win = SDL_CreateWindow("Discrete Hexagon", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, SDL_WINDOW_SHOWN);
     if (!win) failSDL("SDL_CreateWindow");
+    t = ProfileStep("SDL_CreateWindow", "main", t);
 
-    ren = SDL_CreateRenderer(win, -1, 0);
+    Uint32 renFlags = 0;
+    if (softwareRenderer) renFlags |= SDL_RENDERER_SOFTWARE;
+    if (vsync) renFlags |= SDL_RENDERER_PRESENTVSYNC;
+    ren = SDL_CreateRenderer(win, -1, renFlags);
     if (!ren) failSDL("SDL_CreateRenderer");
+    t = ProfileStep("SDL_CreateRenderer", "main", t);
 
     auto format = SDL_PIXELFORMAT_RGBA8888;
     canvas.reset(SDL_CreateTexture(ren, format, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT));
     if (!canvas) failSDL("SDL_CreateTexture canvas");
+    if (SDL_SetTextureScaleMode(canvas.get(), renderScaleFilter) < 0) failSDL("SDL_SetTextureScaleMode");
 
     pixels = new uint32_t[HEIGHT * WIDTH];
     pitch = SDL_BYTESPERPIXEL(format) * WIDTH;
+    if (pipelinedRender && rendererType == RENDERER_CPU) StartShadeThread();
+    t = ProfileStep("SDL_CreateTexture, buffers", "main", t);
+
+    // Show the window straight away, and decode any music while the rest
+    // loads.
+    StartAssetLoad();
+    LoadingFrame();
+    t = ProfileStep("first loading frame", "main", t);
+    if (musicPath) {
+        LoadMusic();
+        if (!beatClock) {
+            beatClock = true;
+            StartBeatDetection();
+        }
+        ProfileStep("LoadMusic", "main", t);
+    }
 
-    Restart();
-
-    prevFrame_ms = SDL_GetTicks();
+    if (fpsCap < 0) fpsCap = vsync ? 0 : DEFAULT_FPS_CAP;
 
     renderAvgTime_ms = 0;
     renderAvgDenom = 0;
 
+    SetRenderScale(renderScale);
+    shadeAvgTime_ms = 0;
+    shadeAvgTimePerPixel_ms = 0;
+    frameAvgTime_ms = 0;
+
     quitRequested = false;
 
 #ifdef __EMSCRIPTEN__
@@ -482,3 +3985,4 @@ int main(int argc, char *argv[])
 
     return 0;
 }
+#endif